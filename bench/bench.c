@@ -0,0 +1,800 @@
+/**
+ * Allocator microbenchmarks.
+ *
+ * The same source is built twice, once against mmal and once against the
+ * system malloc, so that the numbers of both can be compared directly:
+ *
+ *   cc -O2 -DNDEBUG -DBENCH_MMAL -I. bench/bench.c mmal.c -o bench_mmal -lpthread
+ *   cc -O2 -DNDEBUG bench/bench.c -o bench_sys -lpthread
+ *
+ * Usage: bench_xxx [-n ops] [-t threads] [-s seed] [-o option=value]...
+ *                  [workload...]
+ *
+ * Without a workload name every workload is run. -o sets an option of the
+ * default mmal heap before the run (mmal build only), e.g. -o fit=next
+ * -o freelist=1 to compare search policies against plain first-fit. Each workload prints one
+ * line with throughput, resident set size at the end of the measured phase
+ * and p50/p99 latency of a single allocator call (sampled). For the batch
+ * workload a call is a whole batch.
+ *
+ * mmal itself is not thread-safe, so in the mmal build every allocator call
+ * is serialised through one mutex. Multi-threaded numbers therefore measure
+ * mmal behind a global lock, which is how it has to be used today.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef BENCH_MMAL
+#include "mmal.h"
+#include "mmal_ext.h"
+#define ALLOCATOR "mmal"
+
+static pthread_mutex_t mmal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* b_malloc(size_t size){
+    pthread_mutex_lock(&mmal_lock);
+    void* ptr = mmalloc(size);
+    pthread_mutex_unlock(&mmal_lock);
+    return ptr;
+}
+
+static void b_free(void* ptr){
+    pthread_mutex_lock(&mmal_lock);
+    mfree(ptr);
+    pthread_mutex_unlock(&mmal_lock);
+}
+
+static void* b_realloc(void* ptr, size_t size){
+    pthread_mutex_lock(&mmal_lock);
+    void* ret = mrealloc(ptr, size);
+    pthread_mutex_unlock(&mmal_lock);
+    return ret;
+}
+
+static size_t b_malloc_batch(size_t size, size_t n, void** ptrs){
+    pthread_mutex_lock(&mmal_lock);
+    size_t got = mmal_malloc_batch(size, n, ptrs);
+    pthread_mutex_unlock(&mmal_lock);
+    return got;
+}
+
+static void b_free_batch(void** ptrs, size_t n){
+    pthread_mutex_lock(&mmal_lock);
+    mmal_free_batch(ptrs, n);
+    pthread_mutex_unlock(&mmal_lock);
+}
+
+/// Heap options settable with -o.
+static const struct { const char* name; int option; } b_options[] = {
+    { "hugepage",   MMAL_OPT_HUGEPAGE    },
+    { "min_split",  MMAL_OPT_MIN_SPLIT   },
+    { "split_back", MMAL_OPT_SPLIT_BACK  },
+    { "fit",        MMAL_OPT_FIT         },
+    { "freelist",   MMAL_OPT_FREE_LIST   },
+    { "defer",      MMAL_OPT_DEFER_BYTES },
+    { "stream",     MMAL_OPT_STREAM_COPY },
+};
+
+/**
+ * Applies "name=value" to the default heap. 'fit' also takes first/next.
+ */
+static bool b_setopt(const char* arg){
+    const char* eq = strchr(arg, '=');
+    if(eq == NULL) return false;
+    size_t value = strcmp(eq+1, "first") == 0 ? MMAL_FIT_FIRST
+                 : strcmp(eq+1, "next") == 0  ? MMAL_FIT_NEXT
+                 : strtoull(eq+1, NULL, 10);
+    for(size_t i = 0; i < sizeof(b_options)/sizeof(b_options[0]); i++){
+        if(strncmp(arg, b_options[i].name, (size_t)(eq-arg)) == 0
+           && b_options[i].name[eq-arg] == '\0')
+            return mmal_heap_setopt(NULL, b_options[i].option, value);
+    }
+    return false;
+}
+
+/**
+ * Copy strategy 'i' of the copy workload: mrealloc() moves with memcpy,
+ * or with streaming stores whatever the size. NULL past the last one.
+ */
+static const char* b_copy_mode(size_t i){
+    static const char* names[] = { "memcpy", "stream" };
+    if(i >= sizeof(names)/sizeof(names[0])) return NULL;
+    mmal_heap_setopt(NULL, MMAL_OPT_STREAM_COPY, i);
+    return names[i];
+}
+#else
+#define ALLOCATOR "system"
+#define b_malloc  malloc
+#define b_free    free
+#define b_realloc realloc
+
+/// The system malloc has no batch interface, loop over single calls.
+static size_t b_malloc_batch(size_t size, size_t n, void** ptrs){
+    for(size_t i = 0; i < n; i++)
+        if((ptrs[i] = malloc(size)) == NULL) return i;
+    return n;
+}
+
+static void b_free_batch(void** ptrs, size_t n){
+    for(size_t i = 0; i < n; i++) free(ptrs[i]);
+}
+
+/// The system malloc has no options.
+static bool b_setopt(const char* arg){
+    (void)arg;
+    return false;
+}
+
+/// The system realloc has a single copy strategy.
+static const char* b_copy_mode(size_t i){
+    return i == 0 ? "libc" : NULL;
+}
+#endif
+
+/// Every LAT_STRIDE-th allocator call is timed.
+#define LAT_STRIDE 16
+/// Maximum number of latency samples kept per thread.
+#define LAT_MAX    (1<<16)
+
+/**
+ * Per-thread measurement state.
+ */
+typedef struct bench_thread BenchThread;
+struct bench_thread {
+    pthread_t tid;
+    int       id;
+    uint64_t  seed;
+    size_t    ops;          ///< allocator calls made
+    size_t    nlat;         ///< number of latency samples
+    uint32_t  lat[LAT_MAX]; ///< sampled latencies in ns
+    void*     arg;          ///< workload-specific argument
+};
+
+typedef struct {
+    size_t ops;
+    int threads;
+    uint64_t seed;
+} BenchConf;
+
+static BenchConf conf = { .ops = 100000, .threads = 4, .seed = 42 };
+
+static
+uint64_t now_ns(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * xorshift64* pseudo-random generator (cheap and reproducible).
+ */
+static
+uint64_t rnd(uint64_t* s){
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+/**
+ * Random size in [lo, hi], log-uniformly distributed so that small sizes
+ * dominate as they do in real programs.
+ */
+static
+size_t rnd_size(uint64_t* s, size_t lo, size_t hi){
+    int lo_bits = 63 - __builtin_clzll(lo);
+    int hi_bits = 63 - __builtin_clzll(hi);
+    int bits = lo_bits + (int)(rnd(s) % (uint64_t)(hi_bits - lo_bits + 1));
+    size_t size = ((size_t)1 << bits) + (rnd(s) & (((size_t)1 << bits) - 1));
+    return size < lo ? lo : (size > hi ? hi : size);
+}
+
+/**
+ * Resident set size in KiB from /proc/self/statm.
+ */
+static
+long rss_kib(void){
+    long pages_total = 0, pages_res = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f == NULL) return -1;
+    if(fscanf(f, "%ld %ld", &pages_total, &pages_res) != 2) pages_res = -1;
+    fclose(f);
+    return pages_res < 0 ? -1 : pages_res * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/// Timed allocator calls; every LAT_STRIDE-th call records its latency.
+static inline
+void lat_record(BenchThread* t, uint64_t start){
+    if(t->nlat < LAT_MAX) t->lat[t->nlat++] = (uint32_t)(now_ns() - start);
+}
+
+static inline
+void* t_malloc(BenchThread* t, size_t size){
+    if(++t->ops % LAT_STRIDE) return b_malloc(size);
+    uint64_t start = now_ns();
+    void* ptr = b_malloc(size);
+    lat_record(t, start);
+    return ptr;
+}
+
+static inline
+void t_free(BenchThread* t, void* ptr){
+    if(++t->ops % LAT_STRIDE){ b_free(ptr); return; }
+    uint64_t start = now_ns();
+    b_free(ptr);
+    lat_record(t, start);
+}
+
+static inline
+void* t_realloc(BenchThread* t, void* ptr, size_t size){
+    if(++t->ops % LAT_STRIDE) return b_realloc(ptr, size);
+    uint64_t start = now_ns();
+    void* ret = b_realloc(ptr, size);
+    lat_record(t, start);
+    return ret;
+}
+
+/// Touch the block so that the allocator cannot get away with lazy pages.
+static inline
+void touch(void* ptr, size_t size){
+    ((volatile char*)ptr)[0] = 1;
+    ((volatile char*)ptr)[size-1] = 1;
+}
+
+static
+int cmp_u32(const void* a, const void* b){
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Prints one result line. Merges latency samples of all threads.
+ */
+static
+void report(const char* name, BenchThread* th, int nthreads,
+            uint64_t elapsed_ns, long rss){
+    size_t ops = 0, nlat = 0;
+    for(int i = 0; i < nthreads; i++){
+        ops  += th[i].ops;
+        nlat += th[i].nlat;
+    }
+
+    uint32_t p50 = 0, p99 = 0;
+    uint32_t* all = malloc((nlat ? nlat : 1) * sizeof(uint32_t));
+    if(all != NULL && nlat > 0){
+        size_t k = 0;
+        for(int i = 0; i < nthreads; i++){
+            memcpy(&all[k], th[i].lat, th[i].nlat * sizeof(uint32_t));
+            k += th[i].nlat;
+        }
+        qsort(all, nlat, sizeof(uint32_t), cmp_u32);
+        p50 = all[nlat/2];
+        p99 = all[(nlat*99)/100];
+    }
+    free(all);
+
+    double secs = (double)elapsed_ns / 1e9;
+    printf("%-14s %-7s threads=%-2d ops=%-10zu %12.0f ops/s  rss=%7ld KiB"
+           "  p50=%6u ns  p99=%7u ns\n",
+           name, ALLOCATOR, nthreads, ops, secs > 0 ? ops/secs : 0.0,
+           rss, p50, p99);
+    fflush(stdout);
+}
+
+/**
+ * Runs 'fn' on 'nthreads' threads and reports the result.
+ */
+static
+void run_threads(const char* name, void* (*fn)(void*), int nthreads,
+                 void* (*arg_of)(int)){
+    BenchThread* th = calloc((size_t)nthreads, sizeof(BenchThread));
+    if(th == NULL) return;
+
+    uint64_t start = now_ns();
+    for(int i = 0; i < nthreads; i++){
+        th[i].id   = i;
+        th[i].seed = conf.seed + (uint64_t)i*7919 + 1;
+        th[i].arg  = arg_of ? arg_of(i) : NULL;
+        pthread_create(&th[i].tid, NULL, fn, &th[i]);
+    }
+    for(int i = 0; i < nthreads; i++)
+        pthread_join(th[i].tid, NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    report(name, th, nthreads, elapsed, rss_kib());
+    free(th);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Single-thread malloc/free loops by size                                  */
+/* ------------------------------------------------------------------------ */
+
+static
+void bench_loop(void){
+    static const size_t sizes[] = { 16, 64, 256, 1024, 4096, 65536 };
+    static BenchThread t;
+
+    for(size_t i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        memset(&t, 0, sizeof(t));
+        char name[32];
+        snprintf(name, sizeof(name), "loop-%zu", sizes[i]);
+
+        uint64_t start = now_ns();
+        for(size_t n = 0; n < conf.ops/2; n++){
+            void* ptr = t_malloc(&t, sizes[i]);
+            touch(ptr, sizes[i]);
+            t_free(&t, ptr);
+        }
+        report(name, &t, 1, now_ns() - start, rss_kib());
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+/* Random-size churn                                                        */
+/* ------------------------------------------------------------------------ */
+
+#define CHURN_SLOTS 1000
+
+static
+void bench_churn(void){
+    static BenchThread t;
+    memset(&t, 0, sizeof(t));
+    t.seed = conf.seed;
+
+    void* slot[CHURN_SLOTS] = { 0 };
+    uint64_t start = now_ns();
+    for(size_t n = 0; n < conf.ops/2; n++){
+        size_t i = rnd(&t.seed) % CHURN_SLOTS;
+        if(slot[i] != NULL) t_free(&t, slot[i]);
+        size_t size = rnd_size(&t.seed, 8, 4096);
+        slot[i] = t_malloc(&t, size);
+        touch(slot[i], size);
+    }
+    uint64_t elapsed = now_ns() - start;
+    long rss = rss_kib();
+    for(size_t i = 0; i < CHURN_SLOTS; i++)
+        if(slot[i] != NULL) b_free(slot[i]);
+    report("churn", &t, 1, elapsed, rss);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Producer-consumer cross-thread free (xmalloc style)                      */
+/* ------------------------------------------------------------------------ */
+
+#define QUEUE_LEN 1024
+
+/**
+ * Bounded single-producer single-consumer queue of pointers.
+ */
+typedef struct {
+    void* buf[QUEUE_LEN];
+    _Atomic size_t head;
+    _Atomic size_t tail;
+} PtrQueue;
+
+static PtrQueue* queues;
+
+static
+void* prodcons_arg(int i){
+    return &queues[i/2];
+}
+
+static
+void* prodcons_thread(void* arg){
+    BenchThread* t = arg;
+    PtrQueue* q = t->arg;
+    size_t n_items = conf.ops / (size_t)conf.threads;
+
+    if(t->id % 2 == 0){
+        /// Producer: allocate and hand over
+        for(size_t n = 0; n < n_items; n++){
+            size_t size = rnd_size(&t->seed, 16, 1024);
+            void* ptr = t_malloc(t, size);
+            touch(ptr, size);
+            while(q->head - q->tail == QUEUE_LEN) sched_yield();
+            q->buf[q->head % QUEUE_LEN] = ptr;
+            q->head++;
+        }
+    }
+    else{
+        /// Consumer: free what the producer allocated
+        for(size_t n = 0; n < n_items; n++){
+            while(q->head == q->tail) sched_yield();
+            void* ptr = q->buf[q->tail % QUEUE_LEN];
+            q->tail++;
+            t_free(t, ptr);
+        }
+    }
+    return NULL;
+}
+
+static
+void bench_prodcons(void){
+    int pairs = conf.threads/2 > 0 ? conf.threads/2 : 1;
+    queues = calloc((size_t)pairs, sizeof(PtrQueue));
+    if(queues == NULL) return;
+    run_threads("prodcons", prodcons_thread, pairs*2, prodcons_arg);
+    free(queues);
+}
+
+/* ------------------------------------------------------------------------ */
+/* threadtest: every thread allocates a batch and then frees it             */
+/* ------------------------------------------------------------------------ */
+
+#define THREADTEST_BATCH 1000
+
+static
+void* threadtest_thread(void* arg){
+    BenchThread* t = arg;
+    void* batch[THREADTEST_BATCH];
+    size_t rounds = conf.ops / (size_t)conf.threads / (2*THREADTEST_BATCH) + 1;
+
+    for(size_t r = 0; r < rounds; r++){
+        for(size_t i = 0; i < THREADTEST_BATCH; i++){
+            batch[i] = t_malloc(t, 64);
+            touch(batch[i], 64);
+        }
+        for(size_t i = 0; i < THREADTEST_BATCH; i++)
+            t_free(t, batch[i]);
+    }
+    return NULL;
+}
+
+static
+void bench_threadtest(void){
+    run_threads("threadtest", threadtest_thread, conf.threads, NULL);
+}
+
+/* ------------------------------------------------------------------------ */
+/* larson: server simulation, objects outlive the thread that made them     */
+/* ------------------------------------------------------------------------ */
+
+#define LARSON_SLOTS  500
+#define LARSON_ROUNDS 8
+
+static void** larson_slots;
+static pthread_barrier_t larson_barrier;
+
+static
+void* larson_thread(void* arg){
+    BenchThread* t = arg;
+    size_t per_round = conf.ops / (size_t)conf.threads / LARSON_ROUNDS / 2 + 1;
+
+    for(int r = 0; r < LARSON_ROUNDS; r++){
+        /// Each round works on the slot array another thread filled before,
+        /// so most frees hit blocks allocated by a different thread.
+        int owner = (t->id + r) % conf.threads;
+        void** slot = &larson_slots[(size_t)owner * LARSON_SLOTS];
+        for(size_t n = 0; n < per_round; n++){
+            size_t i = rnd(&t->seed) % LARSON_SLOTS;
+            if(slot[i] != NULL) t_free(t, slot[i]);
+            size_t size = rnd_size(&t->seed, 8, 512);
+            slot[i] = t_malloc(t, size);
+            touch(slot[i], size);
+        }
+        pthread_barrier_wait(&larson_barrier);
+    }
+    return NULL;
+}
+
+static
+void bench_larson(void){
+    larson_slots = calloc((size_t)conf.threads * LARSON_SLOTS, sizeof(void*));
+    if(larson_slots == NULL) return;
+    pthread_barrier_init(&larson_barrier, NULL, (unsigned)conf.threads);
+    run_threads("larson", larson_thread, conf.threads, NULL);
+    pthread_barrier_destroy(&larson_barrier);
+    for(size_t i = 0; i < (size_t)conf.threads * LARSON_SLOTS; i++)
+        if(larson_slots[i] != NULL) b_free(larson_slots[i]);
+    free(larson_slots);
+}
+
+/* ------------------------------------------------------------------------ */
+/* cache-thrash and cache-scratch: allocator induced false sharing          */
+/* ------------------------------------------------------------------------ */
+
+#define CACHE_OBJ     8
+#define CACHE_WRITES  1000
+
+static
+void write_obj(void* ptr){
+    volatile char* c = ptr;
+    for(int w = 0; w < CACHE_WRITES; w++)
+        for(int i = 0; i < CACHE_OBJ; i++) c[i]++;
+}
+
+/**
+ * cache-thrash: threads allocate small objects concurrently. An allocator
+ * that hands neighbouring bytes to different threads makes them share a
+ * cache line.
+ */
+static
+void* thrash_thread(void* arg){
+    BenchThread* t = arg;
+    size_t iters = conf.ops / (size_t)conf.threads / 200 + 1;
+    for(size_t n = 0; n < iters; n++){
+        void* ptr = t_malloc(t, CACHE_OBJ);
+        write_obj(ptr);
+        t_free(t, ptr);
+    }
+    return NULL;
+}
+
+static void** scratch_objs;
+
+static
+void* scratch_arg(int i){
+    return scratch_objs[i];
+}
+
+/**
+ * cache-scratch: the objects are allocated next to each other by the main
+ * thread. Each thread frees the one it was given and then allocates again;
+ * an allocator reusing the freed block passively keeps the false sharing.
+ */
+static
+void* scratch_thread(void* arg){
+    BenchThread* t = arg;
+    size_t iters = conf.ops / (size_t)conf.threads / 200 + 1;
+    t_free(t, t->arg);
+    for(size_t n = 0; n < iters; n++){
+        void* ptr = t_malloc(t, CACHE_OBJ);
+        write_obj(ptr);
+        t_free(t, ptr);
+    }
+    return NULL;
+}
+
+static
+void bench_cache(void){
+    run_threads("cache-thrash", thrash_thread, conf.threads, NULL);
+
+    scratch_objs = malloc((size_t)conf.threads * sizeof(void*));
+    if(scratch_objs == NULL) return;
+    for(int i = 0; i < conf.threads; i++)
+        scratch_objs[i] = b_malloc(CACHE_OBJ);
+    run_threads("cache-scratch", scratch_thread, conf.threads, scratch_arg);
+    free(scratch_objs);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Bursts of equal-size objects through the batch interface                 */
+/* ------------------------------------------------------------------------ */
+
+#define BATCH_MAX 256
+/// Blocks kept alive around the batches of the batch-live run.
+#define BATCH_LIVE 100000
+
+/**
+ * Allocate and free bursts of 'BATCH_MAX' or fewer 128 byte objects. With
+ * 'live' the bursts run next to that many live blocks of mixed sizes,
+ * every other one freed, so a free that visits the whole heap shows.
+ */
+static
+void batch_run(const char* name, size_t live){
+    static BenchThread t;
+    memset(&t, 0, sizeof(t));
+    t.seed = conf.seed;
+
+    /// Build the live set, holes included, outside the measurement
+    void** keep = NULL;
+    if(live != 0){
+        keep = malloc(live * sizeof(void*));
+        if(keep == NULL) return;
+        for(size_t i = 0; i < live; i++)
+            keep[i] = b_malloc(16 + rnd(&t.seed) % 241);
+        for(size_t i = 0; i < live; i += 2){
+            b_free(keep[i]);
+            keep[i] = NULL;
+        }
+    }
+
+    /// Latency is sampled per batch call, ops count single objects
+    void* ptrs[BATCH_MAX];
+    size_t calls = 0;
+    uint64_t start = now_ns();
+    while(t.ops < conf.ops){
+        size_t n = 32 + rnd(&t.seed) % (BATCH_MAX - 32 + 1);
+        bool timed = ++calls % LAT_STRIDE == 0;
+        uint64_t call_start = timed ? now_ns() : 0;
+        size_t got = b_malloc_batch(128, n, ptrs);
+        if(timed) lat_record(&t, call_start);
+        for(size_t i = 0; i < got; i++) touch(ptrs[i], 128);
+
+        timed = ++calls % LAT_STRIDE == 0;
+        call_start = timed ? now_ns() : 0;
+        b_free_batch(ptrs, got);
+        if(timed) lat_record(&t, call_start);
+        t.ops += 2*got;
+    }
+    report(name, &t, 1, now_ns() - start, rss_kib());
+
+    if(keep != NULL){
+        for(size_t i = 1; i < live; i += 2) b_free(keep[i]);
+        free(keep);
+    }
+}
+
+static
+void bench_batch(void){
+    batch_run("batch-128", 0);
+    batch_run("batch-128-live", BATCH_LIVE);
+}
+
+/* ------------------------------------------------------------------------ */
+/* realloc growth patterns                                                  */
+/* ------------------------------------------------------------------------ */
+
+static
+void realloc_pattern(const char* name, int doubling){
+    static BenchThread t;
+    memset(&t, 0, sizeof(t));
+    t.seed = conf.seed;
+
+    /// A second, interleaved buffer keeps the growing block from always
+    /// being the last one in the heap.
+    size_t rounds = conf.ops / 2000 + 1;
+    uint64_t start = now_ns();
+    for(size_t r = 0; r < rounds; r++){
+        size_t size = 16, other_size = 16;
+        char* buf   = t_malloc(&t, size);
+        char* other = t_malloc(&t, other_size);
+        while(size < 256*1024){
+            size = doubling ? size*2 : size + 64;
+            buf = t_realloc(&t, buf, size);
+            touch(buf, size);
+            if((rnd(&t.seed) & 3) == 0){
+                other_size += 32;
+                other = t_realloc(&t, other, other_size);
+                touch(other, other_size);
+            }
+            if(!doubling && t.ops > conf.ops*(r+1)/rounds) break;
+        }
+        t_free(&t, other);
+        t_free(&t, buf);
+    }
+    report(name, &t, 1, now_ns() - start, rss_kib());
+}
+
+static
+void bench_realloc(void){
+    realloc_pattern("realloc-x2", 1);
+    realloc_pattern("realloc-+64", 0);
+}
+
+/* ------------------------------------------------------------------------ */
+/* Copy cost of moving reallocs and the cache it evicts                     */
+/* ------------------------------------------------------------------------ */
+
+/// Data the program keeps working on while big blocks move.
+#define COPY_HOT_SIZE (512*1024)
+/// Bytes moved per block size and copy strategy.
+#define COPY_BUDGET   ((size_t)1 << 30)
+
+static
+uint64_t sweep_hot(const char* hot){
+    uint64_t start = now_ns();
+    unsigned sum = 0;
+    for(size_t i = 0; i < COPY_HOT_SIZE; i += 64) sum += ((volatile const char*)hot)[i];
+    (void)sum;
+    return now_ns() - start;
+}
+
+/**
+ * A block written by the program is grown by mrealloc() while a small
+ * block right behind it forces a move. Prints the time per move and the
+ * time of the next pass over a hot working set, which pays for whatever
+ * the copy evicted from the cache. The block size where the stream mode
+ * wins on both is a good MMAL_OPT_STREAM_COPY. The copy workload leaves
+ * the default heap with the last strategy, run it alone to compare
+ * -o stream settings on other workloads.
+ */
+static
+void bench_copy(void){
+    static char hot[COPY_HOT_SIZE];
+    memset(hot, 1, sizeof(hot));
+
+    const char* mode;
+    for(size_t m = 0; (mode = b_copy_mode(m)) != NULL; m++){
+        for(size_t size = 64*1024; size <= 64*1024*1024; size *= 4){
+            size_t rounds = COPY_BUDGET / size;
+            if(rounds > 1000) rounds = 1000;
+            uint64_t move_ns = 0, hot_ns = 0;
+            size_t moved = 0;
+
+            /// The first round maps the arenas and is not counted
+            for(size_t r = 0; r <= rounds; r++){
+                char* buf = b_malloc(size);
+                void* pin = b_malloc(64);
+                memset(buf, (int)r, size);
+                sweep_hot(hot);
+
+                uint64_t start = now_ns();
+                char* grown = b_realloc(buf, size + size/2);
+                uint64_t elapsed = now_ns() - start;
+                uint64_t sweep = sweep_hot(hot);
+                if(r > 0 && grown != buf){
+                    move_ns += elapsed;
+                    hot_ns  += sweep;
+                    moved++;
+                }
+                b_free(pin);
+                b_free(grown);
+            }
+
+            char name[32];
+            snprintf(name, sizeof(name), "copy-%zuk", size/1024);
+            printf("%-14s %-7s mode=%-6s moved=%4zu/%-4zu %10.0f ns/move"
+                   "  hot=%7.0f ns\n",
+                   name, ALLOCATOR, mode, moved, rounds,
+                   moved ? (double)move_ns/moved : 0.0,
+                   moved ? (double)hot_ns/moved : 0.0);
+            fflush(stdout);
+        }
+    }
+}
+
+/* ------------------------------------------------------------------------ */
+
+typedef struct {
+    const char* name;
+    void (*fn)(void);
+} Workload;
+
+static const Workload workloads[] = {
+    { "loop",       bench_loop       },
+    { "churn",      bench_churn      },
+    { "prodcons",   bench_prodcons   },
+    { "threadtest", bench_threadtest },
+    { "larson",     bench_larson     },
+    { "cache",      bench_cache      },
+    { "batch",      bench_batch      },
+    { "realloc",    bench_realloc    },
+    { "copy",       bench_copy       },
+};
+#define N_WORKLOADS (sizeof(workloads)/sizeof(workloads[0]))
+
+static
+void usage(const char* prog){
+    fprintf(stderr, "usage: %s [-n ops] [-t threads] [-s seed] [-o option=value]..."
+                    " [workload...]\n"
+                    "workloads:", prog);
+    for(size_t i = 0; i < N_WORKLOADS; i++)
+        fprintf(stderr, " %s", workloads[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char** argv){
+    int opt;
+    while((opt = getopt(argc, argv, "n:t:s:o:h")) != -1){
+        switch(opt){
+            case 'n': conf.ops = strtoul(optarg, NULL, 10); break;
+            case 't': conf.threads = atoi(optarg); break;
+            case 's': conf.seed = strtoull(optarg, NULL, 10); break;
+            case 'o':
+                if(!b_setopt(optarg)){
+                    fprintf(stderr, "invalid option '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            default:  usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(conf.threads < 1) conf.threads = 1;
+    if(conf.ops < 1000) conf.ops = 1000;
+
+    for(size_t i = 0; i < N_WORKLOADS; i++){
+        bool selected = optind == argc;
+        for(int a = optind; a < argc; a++)
+            if(strcmp(argv[a], workloads[i].name) == 0) selected = true;
+        if(selected) workloads[i].fn();
+    }
+    return 0;
+}
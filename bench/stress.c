@@ -0,0 +1,374 @@
+/**
+ * Long-running fragmentation and RSS stress harness.
+ *
+ * Throughput numbers do not show memory creep, so this harness drives the
+ * allocator through repeating workload phases and samples how much memory
+ * the process keeps mapped and resident compared to what the program
+ * actually holds:
+ *
+ *   ramp-up  live set grows to its target, mostly long-lived objects
+ *   steady   mixed lifetimes: many short, some medium, few long-lived
+ *   spike    burst of large medium-lived allocations on top of steady
+ *   drain    no new allocations, everything dies
+ *
+ * Build like bench.c:
+ *
+ *   cc -O2 -DNDEBUG -DBENCH_MMAL -I. bench/stress.c mmal.c -o stress_mmal -lpthread
+ *   cc -O2 -DNDEBUG bench/stress.c -o stress_sys
+ *
+ * Usage: stress_xxx [-c cycles] [-t ticks_per_phase] [-i sample_every]
+ *                   [-l live_target_kib] [-s seed] [-m maint_ms]
+ *                   [-o option=value]...
+ *
+ * -c 0 runs until killed. -l bounds the live set: an allocation that would
+ * take it past the target is skipped, the summary counts how many were.
+ * -m starts the mmal maintenance thread on the default heap with the given
+ * interval and -o sets an option of the default heap, e.g. -o decay=100
+ * (both mmal build only). One CSV row is written to stdout every sample:
+ *
+ *   tick,ms,cycle,phase,live_kib,mapped_kib,resident_kib,allocs,frees
+ *
+ * In the mmal build mapped_kib is what the default heap has mapped, in the
+ * system build it is VmSize. resident_kib is VmRSS; both /proc/self/statm
+ * numbers include the harness itself, whose bookkeeping is allocated from
+ * the system malloc. A summary with peak ratios goes to stderr at the end.
+ */
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef BENCH_MMAL
+#include "mmal.h"
+#include "mmal_ext.h"
+#define ALLOCATOR "mmal"
+#define s_malloc  mmalloc
+#define s_free    mfree
+
+/// Heap options settable with -o.
+static const struct { const char* name; int option; } s_options[] = {
+    { "hugepage",   MMAL_OPT_HUGEPAGE      },
+    { "min_split",  MMAL_OPT_MIN_SPLIT     },
+    { "split_back", MMAL_OPT_SPLIT_BACK    },
+    { "fit",        MMAL_OPT_FIT           },
+    { "freelist",   MMAL_OPT_FREE_LIST     },
+    { "decay",      MMAL_OPT_DECAY_MS      },
+    { "retain",     MMAL_OPT_RETAIN_MS     },
+    { "spare",      MMAL_OPT_SPARE_BYTES   },
+    { "defer",      MMAL_OPT_DEFER_BYTES   },
+    { "compact",    MMAL_OPT_COMPACT_BYTES },
+    { "soft_limit", MMAL_OPT_SOFT_LIMIT    },
+    { "hard_limit", MMAL_OPT_HARD_LIMIT    },
+};
+
+/**
+ * Applies "name=value" to the default heap. 'fit' also takes first/next.
+ */
+static bool s_setopt(const char* arg){
+    const char* eq = strchr(arg, '=');
+    if(eq == NULL) return false;
+    size_t value = strcmp(eq+1, "first") == 0 ? MMAL_FIT_FIRST
+                 : strcmp(eq+1, "next") == 0  ? MMAL_FIT_NEXT
+                 : strtoull(eq+1, NULL, 10);
+    for(size_t i = 0; i < sizeof(s_options)/sizeof(s_options[0]); i++){
+        if(strncmp(arg, s_options[i].name, (size_t)(eq-arg)) == 0
+           && s_options[i].name[eq-arg] == '\0')
+            return mmal_heap_setopt(NULL, s_options[i].option, value);
+    }
+    return false;
+}
+#else
+#define ALLOCATOR "system"
+#define s_malloc  malloc
+#define s_free    free
+
+/// The system malloc has no options.
+static bool s_setopt(const char* arg){
+    (void)arg;
+    return false;
+}
+#endif
+
+/// Allocations made per tick at the nominal rate.
+#define TICK_ALLOCS 200
+/// Length of the timing wheel, also the longest lifetime in ticks.
+#define WHEEL_LEN   4096
+/// Lifetime meaning "until the drain phase".
+#define FOREVER     0
+
+typedef enum { PH_RAMP, PH_STEADY, PH_SPIKE, PH_DRAIN, PH_COUNT } Phase;
+
+static const char* phase_name[PH_COUNT] = { "ramp", "steady", "spike", "drain" };
+
+/**
+ * A live object and its bookkeeping. Kept outside the tested allocator.
+ */
+typedef struct {
+    void*  ptr;
+    size_t size;
+} Obj;
+
+/**
+ * Growable array of objects.
+ */
+typedef struct {
+    Obj*   v;
+    size_t len;
+    size_t cap;
+} ObjVec;
+
+typedef struct {
+    unsigned long cycles;
+    unsigned long phase_ticks;
+    unsigned long sample_every;
+    size_t live_target;
+    uint64_t seed;
+    unsigned maint_ms;
+} StressConf;
+
+static StressConf conf = {
+    .cycles = 3, .phase_ticks = 2000, .sample_every = 50,
+    .live_target = 64*1024*1024, .seed = 42
+};
+
+/// Objects that die at tick t are stored in wheel[t % WHEEL_LEN].
+static ObjVec wheel[WHEEL_LEN];
+/// Objects living until drain.
+static ObjVec forever;
+
+static size_t live_bytes;
+static unsigned long n_allocs, n_frees, n_skipped;
+
+static
+uint64_t now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000u + (uint64_t)ts.tv_nsec/1000000u;
+}
+
+static
+uint64_t rnd(uint64_t* s){
+    *s ^= *s >> 12;
+    *s ^= *s << 25;
+    *s ^= *s >> 27;
+    return *s * 2685821657736338717ull;
+}
+
+static
+size_t rnd_range(uint64_t* s, size_t lo, size_t hi){
+    return lo + (size_t)(rnd(s) % (hi - lo + 1));
+}
+
+/**
+ * Log-uniform size in [lo, hi].
+ */
+static
+size_t rnd_size(uint64_t* s, size_t lo, size_t hi){
+    int lo_bits = 63 - __builtin_clzll(lo);
+    int hi_bits = 63 - __builtin_clzll(hi);
+    int bits = lo_bits + (int)(rnd(s) % (uint64_t)(hi_bits - lo_bits + 1));
+    size_t size = ((size_t)1 << bits) + (rnd(s) & (((size_t)1 << bits) - 1));
+    return size < lo ? lo : (size > hi ? hi : size);
+}
+
+static
+void vec_push(ObjVec* vec, Obj obj){
+    if(vec->len == vec->cap){
+        size_t cap = vec->cap ? vec->cap*2 : 64;
+        Obj* v = realloc(vec->v, cap*sizeof(Obj));
+        if(v == NULL){
+            perror("realloc");
+            exit(1);
+        }
+        vec->v   = v;
+        vec->cap = cap;
+    }
+    vec->v[vec->len++] = obj;
+}
+
+static
+void vec_release(ObjVec* vec){
+    for(size_t i = 0; i < vec->len; i++){
+        live_bytes -= vec->v[i].size;
+        n_frees++;
+        s_free(vec->v[i].ptr);
+    }
+    vec->len = 0;
+}
+
+/**
+ * Allocates one object that dies after 'lifetime' ticks (FOREVER = drain),
+ * unless it would take the live set past its target.
+ */
+static
+void obj_alloc(unsigned long tick, size_t size, unsigned long lifetime){
+    if(size > conf.live_target - live_bytes){
+        n_skipped++;
+        return;
+    }
+    void* ptr = s_malloc(size);
+    if(ptr == NULL){
+        fprintf(stderr, "allocation of %zu bytes failed at tick %lu\n", size, tick);
+        exit(1);
+    }
+    /// Write the first and last byte of every page, so it becomes resident
+    for(size_t off = 0; off < size; off += 4096) ((volatile char*)ptr)[off] = 1;
+    ((volatile char*)ptr)[size-1] = 1;
+
+    Obj obj = { ptr, size };
+    if(lifetime == FOREVER) vec_push(&forever, obj);
+    else vec_push(&wheel[(tick + lifetime) % WHEEL_LEN], obj);
+    live_bytes += size;
+    n_allocs++;
+}
+
+/**
+ * Reads VmSize and VmRSS in KiB from /proc/self/statm. The mmal build
+ * reports the bytes mapped by the default heap instead of VmSize.
+ */
+static
+void statm_kib(long* mapped, long* resident){
+    long pages_total = -1, pages_res = -1;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if(f != NULL){
+        if(fscanf(f, "%ld %ld", &pages_total, &pages_res) != 2)
+            pages_total = pages_res = -1;
+        fclose(f);
+    }
+    long kib_per_page = sysconf(_SC_PAGESIZE) / 1024;
+    *mapped   = pages_total < 0 ? -1 : pages_total * kib_per_page;
+    *resident = pages_res   < 0 ? -1 : pages_res   * kib_per_page;
+#ifdef BENCH_MMAL
+    *mapped   = (long)(mmal_heap_mapped_bytes(NULL) / 1024);
+#endif
+}
+
+/**
+ * One tick of a phase. 'pos' is the progress within the phase in [0, 1).
+ */
+static
+void phase_tick(Phase ph, unsigned long tick, double pos, uint64_t* seed){
+    /// Objects scheduled for this tick die first
+    vec_release(&wheel[tick % WHEEL_LEN]);
+
+    /// Average object ~ 200 B, so the nominal rate has this many long-lived
+    /// allocations per tick during ramp-up to fill half the live target;
+    /// the other half is left to the steady and spike mix.
+    size_t ramp_long = conf.live_target / 512 / conf.phase_ticks + 1;
+
+    switch(ph){
+        case PH_RAMP:
+            for(size_t i = 0; i < (size_t)(TICK_ALLOCS*pos) + 1; i++)
+                obj_alloc(tick, rnd_size(seed, 8, 1024),
+                          rnd_range(seed, 1, 20));
+            for(size_t i = 0; i < ramp_long; i++)
+                obj_alloc(tick, rnd_size(seed, 16, 512),
+                          (rnd(seed) % 4) ? FOREVER : rnd_range(seed, 500, WHEEL_LEN-1));
+            break;
+
+        case PH_SPIKE:
+            /// Large medium-lived buffers on top of the steady mix
+            for(size_t i = 0; i < TICK_ALLOCS/20; i++)
+                obj_alloc(tick, rnd_size(seed, 4096, 64*1024),
+                          rnd_range(seed, 50, 400));
+            /* fall through */
+        case PH_STEADY:
+            for(size_t i = 0; i < TICK_ALLOCS; i++){
+                unsigned r = (unsigned)(rnd(seed) % 100);
+                if(r < 90)      /// short-lived
+                    obj_alloc(tick, rnd_size(seed, 8, 1024),
+                              rnd_range(seed, 1, 10));
+                else if(r < 99) /// medium-lived
+                    obj_alloc(tick, rnd_size(seed, 32, 4096),
+                              rnd_range(seed, 100, 1000));
+                else            /// long-lived, replaces ramp-up data slowly
+                    obj_alloc(tick, rnd_size(seed, 16, 512),
+                              rnd_range(seed, 1000, WHEEL_LEN-1));
+            }
+            break;
+
+        case PH_DRAIN:
+            /// Long-lived data is released at the start of the drain
+            if(pos == 0.0) vec_release(&forever);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static
+void usage(const char* prog){
+    fprintf(stderr, "usage: %s [-c cycles] [-t ticks_per_phase] [-i sample_every]"
+                    " [-l live_target_kib] [-s seed] [-m maint_ms]"
+                    " [-o option=value]...\n", prog);
+}
+
+int main(int argc, char** argv){
+    int opt;
+    while((opt = getopt(argc, argv, "c:t:i:l:s:m:o:h")) != -1){
+        switch(opt){
+            case 'c': conf.cycles = strtoul(optarg, NULL, 10); break;
+            case 't': conf.phase_ticks = strtoul(optarg, NULL, 10); break;
+            case 'i': conf.sample_every = strtoul(optarg, NULL, 10); break;
+            case 'l': conf.live_target = strtoull(optarg, NULL, 10)*1024; break;
+            case 's': conf.seed = strtoull(optarg, NULL, 10); break;
+            case 'm': conf.maint_ms = (unsigned)strtoul(optarg, NULL, 10); break;
+            case 'o':
+                if(!s_setopt(optarg)){
+                    fprintf(stderr, "invalid option '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            default:  usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if(conf.phase_ticks < 1) conf.phase_ticks = 1;
+    if(conf.sample_every < 1) conf.sample_every = 1;
+#ifdef BENCH_MMAL
+    if(conf.maint_ms > 0 && !mmal_heap_maintenance_start(NULL, conf.maint_ms)){
+        fprintf(stderr, "cannot start the maintenance thread\n");
+        return 1;
+    }
+#endif
+
+    uint64_t seed = conf.seed;
+    uint64_t start = now_ms();
+    unsigned long tick = 0;
+    size_t peak_live = 0;
+    long peak_res = 0, end_res = 0, mapped, resident;
+
+    printf("tick,ms,cycle,phase,live_kib,mapped_kib,resident_kib,allocs,frees\n");
+    for(unsigned long cycle = 0; conf.cycles == 0 || cycle < conf.cycles; cycle++){
+        for(Phase ph = PH_RAMP; ph < PH_COUNT; ph++){
+            /// Drain lasts until every wheel slot has been visited once
+            unsigned long len = ph == PH_DRAIN ? WHEEL_LEN : conf.phase_ticks;
+            for(unsigned long i = 0; i < len; i++, tick++){
+                phase_tick(ph, tick, (double)i/(double)len, &seed);
+                if(live_bytes > peak_live) peak_live = live_bytes;
+
+                if(tick % conf.sample_every == 0 || i == len-1){
+                    statm_kib(&mapped, &resident);
+                    if(resident > peak_res) peak_res = resident;
+                    end_res = resident;
+                    printf("%lu,%llu,%lu,%s,%zu,%ld,%ld,%lu,%lu\n",
+                           tick, (unsigned long long)(now_ms() - start), cycle,
+                           phase_name[ph], live_bytes/1024, mapped, resident,
+                           n_allocs, n_frees);
+                }
+            }
+            fflush(stdout);
+        }
+    }
+
+    fprintf(stderr, "%s: peak live %zu KiB, peak resident %ld KiB (%.2fx),"
+                    " resident after drain %ld KiB, %lu allocations skipped\n",
+            ALLOCATOR, peak_live/1024, peak_res,
+            peak_live ? (double)peak_res*1024/(double)peak_live : 0.0, end_res,
+            n_skipped);
+    return 0;
+}
@@ -1,9 +1,25 @@
+#define _GNU_SOURCE     // memfd_create, program_invocation_short_name
 #include "mmal.h"
+#include "mmal_ext.h"
+#include "mmal_sizeclass.h"
 #include <sys/mman.h>   // mmap
 #include <stdbool.h>    // bool
 #include <assert.h>     // assert
 #include <string.h>     // memcpy
 #include <stdio.h>
+#include <stdint.h>     // uintptr_t
+#include <pthread.h>    // maintenance thread
+#include <time.h>       // clock_gettime
+#include <unistd.h>     // sysconf
+#include <fcntl.h>      // open
+#include <errno.h>      // EOWNERDEAD
+#include <sys/stat.h>   // fstat
+#include <sys/file.h>   // flock
+#include <link.h>       // dl_iterate_phdr
+#include <inttypes.h>   // PRIxPTR
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(MMAL_NO_SIMD)
+#include <immintrin.h>  // AVX2, AVX-512 kernels
+#endif
 
 #ifdef NDEBUG
 /**
@@ -27,7 +43,8 @@ struct header {
 
     /**
      * Size of block in bytes allocated for program. asize=0 means the block 
-     * is not used by a program.
+     * is not used by a program. The top bits tell the state of the block
+     * before it (ASIZE_PREV).
      */
     size_t asize;
 };
@@ -61,6 +78,347 @@ struct arena {
 
 Arena* first_arena = NULL;
 
+/**
+ * The heap structure. A heap is a list of arenas together with the cyclic
+ * list of headers going through all of them.
+ */
+struct mmal_heap {
+    /**
+     * Pointer to the head of the arena list. The default heap keeps its
+     * arenas in the global 'first_arena', other heaps in 'arenas'.
+     */
+    Arena **first_arena;
+
+    /// Head of the arena list of heaps made by mmal_heap_create().
+    Arena *arenas;
+
+    /**
+     * File-backed heap (mmal_heap_open_file()): the mapping of the whole
+     * file and the open file. The only arena of the heap is part of the
+     * mapping; arenas are never mapped or unmapped. NULL and -1 otherwise.
+     */
+    void *map;
+    size_t map_size;
+    int fd;
+
+    /**
+     * Shared heap (mmal_heap_create_shared()): the structure itself lives
+     * in the shared mapping, 'lock' is process-shared and every call on
+     * the heap takes it.
+     */
+    bool shared;
+
+    /**
+     * MMAL_OPT_HUGEPAGE: arenas are HUGE_PAGE_SIZE aligned and sized and
+     * advised for transparent huge pages. Memory is returned to the system
+     * only in whole huge pages, so they are never split.
+     */
+    bool hugepage;
+
+    /**
+     * Serialises the heap against its maintenance thread. Taken by the
+     * public API only while the thread runs (see heap_lock()).
+     */
+    pthread_mutex_t lock;
+
+    /// Maintenance thread, valid while 'maint_running'.
+    pthread_t maint_thread;
+    pthread_cond_t maint_wake;
+    bool maint_running;
+    bool maint_stop;
+    unsigned maint_interval_ms;
+
+    /// MMAL_OPT_MIN_SPLIT and MMAL_OPT_SPLIT_BACK.
+    size_t min_split;
+    bool split_back;
+
+    /// MMAL_OPT_FIT: MMAL_FIT_FIRST or MMAL_FIT_NEXT.
+    int fit;
+
+    /**
+     * Block the next search starts from with MMAL_FIT_NEXT, NULL for the
+     * start of the heap. Always a header of the ring, with a free list
+     * always a block on the list.
+     */
+    Header *rover;
+
+    /**
+     * Block before the next one the compactor (mmal_heap_compact()) looks
+     * at, NULL to start a new pass. Kept on a header of the ring like the
+     * rover.
+     */
+    Header *compact;
+
+    /// MMAL_OPT_COMPACT_BYTES.
+    size_t compact_bytes;
+
+    /// MMAL_OPT_STREAM_COPY.
+    size_t stream_copy;
+
+    /**
+     * Bytes of all arenas of the heap, and MMAL_OPT_SOFT_LIMIT and
+     * MMAL_OPT_HARD_LIMIT on them, 0 for no limit.
+     */
+    size_t mapped_bytes;
+    size_t soft_limit;
+    size_t hard_limit;
+
+    /// Called when the heap cannot grow (mmal_heap_set_oom_handler()).
+    mmal_oom_handler_t oom;
+    void *oom_arg;
+
+    /**
+     * MMAL_OPT_FREE_LIST: doubly linked list of the free blocks, linked
+     * through their data (FreeLink). Searches visit free blocks only, mfree
+     * finds a free left neighbour by its boundary tag (FreeFoot). With
+     * 'free_ordered' the list is kept in address order, else a block with
+     * no free neighbour goes to its head.
+     */
+    bool free_list;
+    bool free_ordered;
+    Header *free_head;
+
+    /// MMAL_OPT_DECAY_MS, MMAL_OPT_RETAIN_MS and MMAL_OPT_SPARE_BYTES.
+    size_t decay_ms;
+    size_t retain_ms;
+    size_t spare_bytes;
+
+    /**
+     * Deferred coalescing (MMAL_OPT_DEFER_BYTES). Freed blocks of a size
+     * class wait unmerged on 'quick', linked through their data, until
+     * 'quick_bytes' exceeds 'defer_bytes' or an allocation misses.
+     */
+    Header *quick[MMAL_SC_NCLASSES];
+    size_t quick_bytes;
+    size_t defer_bytes;
+};
+
+/**
+ * The top bits of asize tell whether the block right before in the same
+ * arena is free: ASIZE_PREV_FREE if it ends in a FreeFoot, ASIZE_PREV_SMALL
+ * if it is too small for one. No requested size reaches them; hdr_asize()
+ * masks them off.
+ */
+#define ASIZE_PREV_FREE     ((size_t)1 << (sizeof(size_t)*8 - 1))
+#define ASIZE_PREV_SMALL    ((size_t)1 << (sizeof(size_t)*8 - 2))
+#define ASIZE_PREV          (ASIZE_PREV_FREE | ASIZE_PREV_SMALL)
+
+/// asize of a block waiting on a quick list: neither free nor allocated.
+#define ASIZE_QUICK (SIZE_MAX & ~ASIZE_PREV)
+
+/// Default of MMAL_OPT_MIN_SPLIT: the smallest size class.
+#define DEFAULT_MIN_SPLIT MMAL_SC_QUANTUM
+/// Default of MMAL_OPT_DECAY_MS.
+#define DEFAULT_DECAY_MS  10000
+/// Default of MMAL_OPT_RETAIN_MS.
+#define DEFAULT_RETAIN_MS 30000
+/// Default of MMAL_OPT_STREAM_COPY.
+#define DEFAULT_STREAM_COPY ((size_t)4 << 20)
+
+/**
+ * Initializer of a heap keeping its arena list head in '*first'.
+ */
+#define HEAP_INIT(first) {                      \
+    .first_arena = (first),                     \
+    .fd          = -1,                          \
+    .lock        = PTHREAD_MUTEX_INITIALIZER,   \
+    .maint_wake  = PTHREAD_COND_INITIALIZER,    \
+    .min_split   = DEFAULT_MIN_SPLIT,           \
+    .free_list   = true,                        \
+    .decay_ms    = DEFAULT_DECAY_MS,            \
+    .retain_ms   = DEFAULT_RETAIN_MS,           \
+    .stream_copy = DEFAULT_STREAM_COPY,         \
+}
+
+/// The heap used by mmalloc, mfree and mrealloc.
+static mmal_heap_t default_heap = HEAP_INIT(&first_arena);
+
+/**
+ * Pools of mmal_malloc_hint(): short-lived and long-lived blocks are kept
+ * in arenas of their own. mfree and friends find the pool of a block in
+ * the pagemap.
+ */
+#define HINT_POOLS 2
+#define POOL_SHORT 0
+#define POOL_LONG  1
+static mmal_heap_t hint_heaps[HINT_POOLS] = {
+    HEAP_INIT(&hint_heaps[POOL_SHORT].arenas),
+    HEAP_INIT(&hint_heaps[POOL_LONG].arenas),
+};
+
+/// Size of a transparent huge page.
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+/**
+ * Return the heap the public API should work on.
+ */
+static inline
+mmal_heap_t* heap_of(mmal_heap_t* heap){
+    return heap != NULL ? heap : &default_heap;
+}
+
+/**
+ * Lock the heap if its maintenance thread runs or other processes share
+ * it. Otherwise mmal stays lock-free and single-threaded as before.
+ */
+static inline
+void heap_lock(mmal_heap_t* heap){
+    if(heap->shared){
+        /// The owner died holding the lock, take it over
+        if(pthread_mutex_lock(&heap->lock) == EOWNERDEAD)
+            pthread_mutex_consistent(&heap->lock);
+    }
+    else if(heap->maint_running){
+        pthread_mutex_lock(&heap->lock);
+    }
+}
+
+static inline
+void heap_unlock(mmal_heap_t* heap){
+    if(heap->maint_running || heap->shared) pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * Kernels with AVX2 and AVX-512 variants. simd_init() points bitmap_scan
+ * and copy_stream at the best ones the CPU supports on their first use;
+ * the variants are compiled with target attributes, so the file needs no
+ * -mavx2 and still runs on any x86-64. MMAL_NO_SIMD leaves the plain ones.
+ */
+
+/**
+ * Index of the first word of 'words[from..n)' with a clear bit, 'n' if all
+ * are full. The AVX2 and AVX-512 kernels compare 4 and 8 words at once.
+ */
+static
+size_t bitmap_scan_word(const uint64_t* words, size_t from, size_t n){
+    while(from < n && ~words[from] == 0) from++;
+    return from;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(MMAL_NO_SIMD)
+#define HAVE_SIMD
+
+__attribute__((target("avx2,bmi")))
+static
+size_t bitmap_scan_avx2(const uint64_t* words, size_t from, size_t n){
+    const __m256i full = _mm256_set1_epi64x(-1);
+    for(; from + 4 <= n; from += 4){
+        __m256i v = _mm256_loadu_si256((const __m256i*)&words[from]);
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi64(v, full));
+        if(mask != 0xFFFFFFFFu) return from + (unsigned)__builtin_ctz(~mask) / 8;
+    }
+    return bitmap_scan_word(words, from, n);
+}
+
+__attribute__((target("avx512f,bmi")))
+static
+size_t bitmap_scan_avx512(const uint64_t* words, size_t from, size_t n){
+    const __m512i full = _mm512_set1_epi64(-1);
+    for(; from + 8 <= n; from += 8){
+        __m512i v = _mm512_loadu_si512((const void*)&words[from]);
+        unsigned mask = _mm512_cmpneq_epu64_mask(v, full);
+        if(mask != 0) return from + (unsigned)__builtin_ctz(mask);
+    }
+    return bitmap_scan_word(words, from, n);
+}
+
+/**
+ * Copy 'size' bytes with non-temporal stores, which go around the cache:
+ * a big block moved by mrealloc() would otherwise evict the data the
+ * program works on. The stores start at the first vector aligned byte of
+ * 'dst' and are fenced before the copy returns.
+ */
+__attribute__((target("avx2")))
+static
+void copy_stream_avx2(void* dst, const void* src, size_t size){
+    char* d = dst;
+    const char* s = src;
+    size_t head = (size_t)(-(uintptr_t)d & 31);
+    if(head > size) head = size;
+    memcpy(d, s, head);
+    d += head, s += head, size -= head;
+
+    for(; size >= 128; d += 128, s += 128, size -= 128){
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)s);
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(s+32));
+        __m256i v2 = _mm256_loadu_si256((const __m256i*)(s+64));
+        __m256i v3 = _mm256_loadu_si256((const __m256i*)(s+96));
+        _mm256_stream_si256((__m256i*)d, v0);
+        _mm256_stream_si256((__m256i*)(d+32), v1);
+        _mm256_stream_si256((__m256i*)(d+64), v2);
+        _mm256_stream_si256((__m256i*)(d+96), v3);
+    }
+    _mm_sfence();
+    memcpy(d, s, size);
+}
+
+__attribute__((target("avx512f")))
+static
+void copy_stream_avx512(void* dst, const void* src, size_t size){
+    char* d = dst;
+    const char* s = src;
+    size_t head = (size_t)(-(uintptr_t)d & 63);
+    if(head > size) head = size;
+    memcpy(d, s, head);
+    d += head, s += head, size -= head;
+
+    for(; size >= 256; d += 256, s += 256, size -= 256){
+        __m512i v0 = _mm512_loadu_si512((const void*)s);
+        __m512i v1 = _mm512_loadu_si512((const void*)(s+64));
+        __m512i v2 = _mm512_loadu_si512((const void*)(s+128));
+        __m512i v3 = _mm512_loadu_si512((const void*)(s+192));
+        _mm512_stream_si512((void*)d, v0);
+        _mm512_stream_si512((void*)(d+64), v1);
+        _mm512_stream_si512((void*)(d+128), v2);
+        _mm512_stream_si512((void*)(d+192), v3);
+    }
+    _mm_sfence();
+    memcpy(d, s, size);
+}
+#endif
+
+static size_t (*bitmap_scan)(const uint64_t* words, size_t from, size_t n) = bitmap_scan_word;
+/// NULL if the CPU has no streaming kernel, block_copy() uses memcpy.
+static void (*copy_stream)(void* dst, const void* src, size_t size) = NULL;
+static bool simd_ready = false;
+
+/**
+ * Choose the kernels for this CPU.
+ */
+static
+void simd_init(void){
+#ifdef HAVE_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx512f")){
+        bitmap_scan = bitmap_scan_avx512;
+        copy_stream = copy_stream_avx512;
+    }
+    else if(__builtin_cpu_supports("avx2")){
+        bitmap_scan = bitmap_scan_avx2;
+        copy_stream = copy_stream_avx2;
+    }
+#endif
+    simd_ready = true;
+}
+
+/**
+ * Copy the data of a block that moves to a new place. Blocks of at least
+ * MMAL_OPT_STREAM_COPY bytes are copied with non-temporal stores.
+ */
+static
+void block_copy(mmal_heap_t* heap, void* dst, const void* src, size_t size){
+    if(heap->stream_copy == 0 || size < heap->stream_copy){
+        memcpy(dst, src, size);
+        return;
+    }
+
+    if(!simd_ready) simd_init();
+    if(copy_stream != NULL)
+        copy_stream(dst, src, size);
+    else
+        memcpy(dst, src, size);
+}
+
 /**
  * Return size alligned to PAGE_SIZE
  */
@@ -69,9 +427,41 @@ size_t allign_page(size_t size) {
     return (size<PAGE_SIZE)?PAGE_SIZE:((size/PAGE_SIZE)+1)*PAGE_SIZE;
 }
 
+/**
+ * Map anonymous memory aligned to 'alignment'. More is mapped and the
+ * unaligned head and the tail are unmapped again.
+ * @param size      size of the mapping, multiple of the system page size
+ * @param alignment power of two, multiple of the system page size
+ * @return pointer to the mapping or NULL if error.
+ */
+static
+void* map_aligned(size_t size, size_t alignment){
+    char* raw = mmap(   NULL, size+alignment,
+                        PROT_WRITE|PROT_READ,
+                        MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    if(raw == MAP_FAILED) return NULL;
+
+    uintptr_t aligned = ((uintptr_t)raw + alignment-1) & ~(uintptr_t)(alignment-1);
+    size_t head = aligned - (uintptr_t)raw;
+    if(head > 0) munmap(raw, head);
+    if(alignment-head > 0) munmap((char*)aligned + size, alignment-head);
+    return (void*)aligned;
+}
+
+/**
+ * Size of the arena arena_alloc() maps for 'req_size' bytes.
+ */
+static inline
+size_t arena_size_of(size_t req_size, bool huge){
+    if(huge) return (req_size + HUGE_PAGE_SIZE-1) & ~(size_t)(HUGE_PAGE_SIZE-1);
+    return allign_page(req_size);
+}
+
 /**
  * Allocate a new arena using mmap.
  * @param req_size requested size in bytes. Should be alligned to PAGE_SIZE.
+ * @param huge      map a HUGE_PAGE_SIZE aligned arena of whole huge pages
+ *                  and advise transparent huge pages for it
  * @return pointer to a new arena, if successfull. NULL if error.
  * @pre req_size > sizeof(Arena) + sizeof(Header)
  */
@@ -83,17 +473,29 @@ size_t allign_page(size_t size) {
  *   |--------------- Arena.size ---------------|
  */
 static
-Arena* arena_alloc(size_t req_size){
+Arena* arena_alloc(size_t req_size, bool huge){
     /// Check function arguments
     if(req_size <= sizeof(Arena)+sizeof(Header))
         fprintf(stderr,"%s\n","Arena Allocation Failed");
     
     /// Map the requested space into virtual memory
-    size_t arena_size = allign_page(req_size);
-    Arena* tmp = mmap(  NULL, arena_size,
-                        PROT_WRITE|PROT_READ,
-                        MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
-    if(tmp == NULL) return NULL;
+    size_t arena_size;
+    Arena* tmp;
+    if(huge){
+        arena_size = arena_size_of(req_size, true);
+        tmp = map_aligned(arena_size, HUGE_PAGE_SIZE);
+        if(tmp == NULL) return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(tmp, arena_size, MADV_HUGEPAGE);
+#endif
+    }
+    else{
+        arena_size = arena_size_of(req_size, false);
+        tmp = mmap( NULL, arena_size,
+                    PROT_WRITE|PROT_READ,
+                    MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if(tmp == MAP_FAILED) return NULL;
+    }
     
     /// Initialize 'tmp' structure
     tmp->next = NULL;
@@ -102,21 +504,167 @@ Arena* arena_alloc(size_t req_size){
 }
 
 /**
- * Appends a new arena to the end of the arena list.
+ * Inserts a new arena to the arena list, which is kept in address order.
+ * @param heap      heap owning the arena
  * @param a already allocated arena
+ * @return the arena before 'a' in the list, NULL if 'a' is the first one.
  */
 static
-void arena_append(Arena* a){
-    /// Check function argument
-    if(first_arena == NULL){
-        first_arena = a;
-        return;
+Arena* arena_insert(mmal_heap_t* heap, Arena* a){
+    /// Find the last arena below 'a'
+    Arena* prev = NULL;
+    Arena* next = *heap->first_arena;
+    while(next != NULL && (uintptr_t)next < (uintptr_t)a){
+        prev = next;
+        next = next->next;
+    }
+
+    /// Link 'a' in between
+    a->next = next;
+    if(prev == NULL) *heap->first_arena = a;
+    else prev->next = a;
+    return prev;
+}
+
+/**
+ * Unmap every arena of the list starting at 'arena'.
+ */
+static
+void arena_unmap_list(Arena* arena){
+    while(arena != NULL){
+        Arena* next = arena->next;
+        munmap(arena, arena->size);
+        arena = next;
     }
+}
+
+/**
+ * Links of a free block in the free list of its heap (MMAL_OPT_FREE_LIST),
+ * kept at the start of the data of the block, so allocated blocks pay
+ * nothing for the list. The list is in address order with value 2 of the
+ * option only.
+ */
+typedef struct free_link FreeLink;
+struct free_link {
+    /// Next free block in the list, NULL at the end of the list.
+    Header *next;
+
+    /// Previous free block in the list, NULL at the head.
+    Header *prev;
+};
+
+#define FREE_LINK(hdr)      ((FreeLink*)(&(hdr)[1]))
+
+/// Every block has room for its links: no split leaves less than
+/// MMAL_OPT_MIN_SPLIT and no size class is smaller.
+_Static_assert(MMAL_SC_QUANTUM >= sizeof(FreeLink), "smallest class cannot hold FreeLink");
+
+/**
+ * Bookkeeping of the maintenance pass, kept in the data of a free block
+ * after its FreeLink. 'tag' is valid only while the pass has seen the
+ * block free and nothing changed it since; every change of a free block
+ * resets it.
+ *   ---+------+--------+--------+----------------------------+---
+ *      |Header|FreeLink|FreeInfo|..... purged in pages ......|
+ *   ---+------+--------+--------+----------------------------+---
+ */
+typedef struct free_info FreeInfo;
+struct free_info {
+    /// FREE_INFO_TAG(hdr) if valid.
+    uintptr_t tag;
+
+    /// Time in ms the block was first seen free.
+    uint64_t since;
+
+    /// The pages of the block were returned to the system.
+    bool purged;
+};
+
+/**
+ * Boundary tag of a free block on the free list, kept at the end of its
+ * data, so that mfree of the block after it finds it without a search
+ * once ASIZE_PREV in its header tells that it is free. Blocks with less
+ * than FREE_FOOT_MIN bytes of data have no room for one next to their
+ * FreeLink; they are found by their header, which lies at a fixed
+ * distance.
+ *   ---+------+--------+------------------------------+--------+---
+ *      |Header|FreeLink|..............................|FreeFoot|
+ *   ---+------+--------+------------------------------+--------+---
+ */
+typedef struct free_foot FreeFoot;
+struct free_foot {
+    /// Size of the block.
+    size_t size;
+
+    /// FREE_FOOT_TAG(hdr), checked in debug builds.
+    uintptr_t tag;
+};
 
-    /// Add 'a' to the end of 'first_arena' linked list
-    Arena* last_arena = first_arena;
-    while(last_arena->next != NULL) last_arena = last_arena->next;
-    last_arena -> next = a;
+/// Boundary tag of the block ending at 'end'.
+#define FREE_FOOT(end)      (&((FreeFoot*)(end))[-1])
+#define FREE_FOOT_TAG(hdr)  ((uintptr_t)(hdr) ^ (uintptr_t)0x6d6d616c666f6f74ull)
+/// Smallest block with room for a FreeFoot.
+#define FREE_FOOT_MIN       (sizeof(FreeLink) + sizeof(FreeFoot))
+
+#define FREE_INFO(hdr)      ((FreeInfo*)((char*)(&(hdr)[1]) + sizeof(FreeLink)))
+#define FREE_INFO_TAG(hdr)  ((uintptr_t)(hdr) ^ (uintptr_t)0x6d6d616c66726565ull)
+/// Smallest block with room for a FreeInfo next to its FreeLink and FreeFoot.
+#define FREE_INFO_MIN       (sizeof(FreeLink) + sizeof(FreeInfo) + sizeof(FreeFoot))
+
+/**
+ * Forget what the maintenance pass knows about a (now) free block.
+ */
+static inline
+void free_info_reset(Header* hdr){
+    if(hdr->size >= FREE_INFO_MIN) FREE_INFO(hdr)->tag = 0;
+}
+
+/**
+ * Return the pages in the data of a free block to the system. The block
+ * stays in the heap; its pages come back zeroed on the next touch. The
+ * FreeLink and FreeInfo at the start of the data and the FreeFoot at its
+ * end are kept.
+ * @param hdr       header of the free block
+ * @param granule   purge granularity, the system page or HUGE_PAGE_SIZE
+ */
+static
+void hdr_purge(Header* hdr, size_t granule){
+    uintptr_t start = (uintptr_t)(&hdr[1]) + sizeof(FreeLink) + sizeof(FreeInfo);
+    uintptr_t end   = (uintptr_t)(&hdr[1]) + hdr->size - sizeof(FreeFoot);
+    start = (start + granule-1) & ~(uintptr_t)(granule-1);
+    end   = end & ~(uintptr_t)(granule-1);
+    if(end > start) madvise((void*)start, end-start, MADV_DONTNEED);
+}
+
+/**
+ * Size of a block requested by the program, 0 if the block is free.
+ */
+static inline
+size_t hdr_asize(const Header* hdr){
+    return hdr->asize & ~ASIZE_PREV;
+}
+
+/**
+ * Tell the block right after 'hdr' in its arena whether 'hdr' is free.
+ * Called whenever the state, size or ring successor of 'hdr' changes.
+ */
+static inline
+void hdr_mark_next(Header* hdr){
+    Header* next = hdr->next;
+    if(next == NULL || (char*)(&hdr[1]) + hdr->size != (char*)next) return;
+
+    next->asize &= ~ASIZE_PREV;
+    if(hdr_asize(hdr) == 0)
+        next->asize |= hdr->size < FREE_FOOT_MIN ? ASIZE_PREV_SMALL : ASIZE_PREV_FREE;
+}
+
+/**
+ * Set the requested size of a block, 0 to free it.
+ */
+static inline
+void hdr_set_asize(Header* hdr, size_t asize){
+    hdr->asize = (hdr->asize & ASIZE_PREV) | asize;
+    hdr_mark_next(hdr);
 }
 
 /**
@@ -143,23 +691,27 @@ void hdr_ctor(Header* hdr, size_t size){
     hdr -> size  = size;
     hdr -> asize = 0;
     hdr -> next  = NULL;
+    free_info_reset(hdr);
 }
 
 /**
  * Checks if the given free block should be split in two separate blocks.
  * @param hdr       header of the free block
  * @param size      requested size of data
+ * @param min_split smallest data size of the remainder block
  * @return true if the block should be split
  * @pre hdr->asize == 0
  * @pre size > 0
  */
 static
-bool hdr_should_split(Header *hdr, size_t size){
+bool hdr_should_split(Header *hdr, size_t size, size_t min_split){
     /// Check function arguments & necessary conditions
-    if(hdr == NULL || hdr->asize != 0 || size == 0) return false;
+    if(hdr == NULL || hdr_asize(hdr) != 0 || size == 0) return false;
 
-    /// Check if remaining size isn't 0
-    return (hdr->size-sizeof(Header)-size) > 0;
+    /// Check if the remainder can hold a header and at least 'min_split'
+    /// bytes. Smaller remainders are handed out with the block.
+    if(hdr->size < size) return false;
+    return hdr->size - size >= sizeof(Header) + min_split;
 }
 
 /**
@@ -200,6 +752,8 @@ Header* hdr_split(Header* hdr, size_t req_size){
     /// Reassign linked list pointers
     new_hdr -> next = hdr->next;
     hdr -> next = new_hdr;
+    hdr_mark_next(hdr);
+    hdr_mark_next(new_hdr);
 
     return new_hdr;
 }
@@ -217,15 +771,13 @@ bool hdr_can_merge(Header* left, Header* right){
     /// Check function arguments
     if(left==NULL || right==NULL) return false;
 
-    /// Check if both headers are in one arena
-    Arena* last_arena = first_arena;
-    while(last_arena->next != NULL){
-        if(right->next!=(Header*)(&last_arena[1])) return false;
-        last_arena = last_arena->next;
-    }
+    /// Check if both headers are in one arena. The last block of an arena
+    /// ends at the end of the arena, which is never where the first header
+    /// of another arena lies (it is preceded by the Arena structure).
+    if((char*)(&left[1]) + left->size != (char*)right) return false;
 
     /// Check if headers are both free and adjecent
-    return (left->asize==0 && right->asize==0 && left->next==right && left != right && left < right);
+    return (hdr_asize(left)==0 && hdr_asize(right)==0 && left->next==right && left != right && left < right);
 }
 
 /**
@@ -243,179 +795,2770 @@ void hdr_merge(Header *left, Header *right){
     /// Set new header size
     left->size+=right->size+sizeof(Header);
 
-    /// Reassign 'Header' linked list pointers
+    /// Reassign 'Header' linked list pointers. The right header is now
+    /// data; it must not pass for a free block.
     left->next=right->next;
+    right->next=NULL;
+    hdr_mark_next(left);
 }
 
 /**
- * Finds the first free block that fits to the requested size.
- * @param size      requested size
- * @return pointer to the header of the block or NULL if no block is available.
- * @pre size > 0
+ * Merge two adjacent blocks of a heap, keeping the rover on a header of
+ * the ring. The free list is left to the caller.
+ * @pre left->next == right
  */
 static
-Header* first_fit(size_t size)
-{
-    /// Check function argument
-    if(size <= 0 || first_arena == NULL) return NULL;
-
-    /// Loop through each header and check for size and availability
-    Header* appropriate_hdr = (Header*)(&first_arena[1]);
-    while(appropriate_hdr->next != (Header*)(&first_arena[1])){
-        if(appropriate_hdr->asize == 0 && appropriate_hdr->size >= size)
-            return appropriate_hdr;
-        appropriate_hdr = appropriate_hdr->next;
-    }
-    if(appropriate_hdr->asize == 0 && appropriate_hdr->size >= size)
-        return appropriate_hdr;
-    else 
-        return NULL;
+void heap_merge(mmal_heap_t* heap, Header* left, Header* right){
+    if(heap->rover == right) heap->rover = left;
+    if(heap->compact == right) heap->compact = left;
+    hdr_merge(left, right);
 }
 
 /**
- * Search the header which is the predecessor to the hdr. Note that if 
- * @param hdr       successor of the search header
- * @return pointer to predecessor, hdr if there is just one header.
- * @pre first_arena != NULL
- * @post predecessor->next == hdr
+ * Last block of the free list below 'hdr' in address order. Only free
+ * blocks are visited.
+ * @return the block or NULL if there is none.
+ * @pre heap->free_ordered
  */
 static
-Header* hdr_get_prev(Header* hdr){
-    /// Check function argument
-    if(first_arena == NULL || hdr == NULL) return hdr;
-
-    /// Loop through 'Header' linked list and find 'hdr' predecessor
-    Header* temp = hdr;
-    while(temp->next != hdr) temp = temp->next;
-    return temp;
+Header* free_prev(mmal_heap_t* heap, Header* hdr){
+    Header* prev = NULL;
+    for(Header* next = heap->free_head;
+        next != NULL && (uintptr_t)next < (uintptr_t)hdr;
+        next = FREE_LINK(next)->next)
+        prev = next;
+    return prev;
 }
 
 /**
- * Allocate memory. Use first-fit search of available block.
- * @param size      requested size for program
- * @return pointer to allocated data or NULL if error or size = 0.
+ * Write the boundary tag of a free block after its size changed.
  */
-void* mmalloc(size_t size){
-    /// Check function argument
-    if(size <= 0) return NULL;
+static inline
+void free_foot(mmal_heap_t* heap, Header* hdr){
+    if(!heap->free_list || hdr->size < FREE_FOOT_MIN) return;
 
-    /// Find free space
-    Header* free_hdr = first_fit(size);
-    if(free_hdr != NULL){
-        /// True: Split unsed space
+    FreeFoot* foot = FREE_FOOT((char*)(&hdr[1]) + hdr->size);
+    foot->size = hdr->size;
+    foot->tag  = FREE_FOOT_TAG(hdr);
+}
 
-        if(hdr_should_split(free_hdr, size))
-            hdr_split(free_hdr, size);
+/**
+ * Check if 'left' is the free block right before 'hdr'.
+ */
+static inline
+bool free_adjacent(Header* left, Header* hdr){
+    return  hdr_asize(left) == 0 && left->next == hdr
+            && (char*)(&left[1]) + left->size == (char*)hdr;
+}
 
+/**
+ * Free block right before 'hdr' in its arena, as its header tells. A block
+ * with a FreeFoot is found through it, a smaller one at its fixed distance.
+ * No other block is visited.
+ * @return the block or NULL if the block before is allocated or 'hdr' is
+ * the first block of its arena.
+ * @pre heap->free_list, so that free blocks have their FreeFoot
+ */
+static
+Header* free_left(Header* hdr){
+    Header* left;
+    switch(hdr->asize & ASIZE_PREV){
+        case ASIZE_PREV_FREE:
+            left = (Header*)((uintptr_t)hdr - sizeof(Header) - FREE_FOOT(hdr)->size);
+            assert(FREE_FOOT(hdr)->tag == FREE_FOOT_TAG(left));
+            break;
+        case ASIZE_PREV_SMALL:
+            /// A smaller size read at its distance lands in the header of
+            /// a bigger block, on its asize, which is no size of a block
+            left = (Header*)((char*)hdr - sizeof(Header) - sizeof(FreeLink));
+            while(left->size != (size_t)((char*)hdr - (char*)(&left[1])))
+                left = (Header*)((char*)left - MMAL_MIN_ALIGN);
+            break;
+        default:
+            return NULL;
     }
-    else{
-        /// False: Create new space
-        Arena* new_arena = arena_alloc(size+sizeof(Arena)+sizeof(Header));
-        if(new_arena == NULL) fprintf(stderr,"Arena Allocation Failed\n");
-        arena_append(new_arena);
-        free_hdr = (Header*)(&new_arena[1]);
-        hdr_ctor(free_hdr, new_arena->size-sizeof(Arena)-sizeof(Header));
-
-        /// Assign 'Header' linked list pointers
-        free_hdr->next = (Header*)(&first_arena[1]);
-        hdr_get_prev((Header*)(&first_arena[1])) -> next = free_hdr;
+    assert(free_adjacent(left, hdr));
+    return left;
+}
 
-        /// Split unsued space
+/**
+ * Link a free block into the free list after 'prev'.
+ * @param prev      block before 'hdr' in the list, NULL to link at the head
+ */
+static
+void free_insert(mmal_heap_t* heap, Header* prev, Header* hdr){
+    if(!heap->free_list) return;
 
-        if(hdr_should_split(free_hdr, size)){
-            hdr_split(free_hdr, size);
-        }
+    Header* next = prev != NULL ? FREE_LINK(prev)->next : heap->free_head;
+    FREE_LINK(hdr)->prev = prev;
+    FREE_LINK(hdr)->next = next;
+    if(prev != NULL) FREE_LINK(prev)->next = hdr;
+    else heap->free_head = hdr;
+    if(next != NULL) FREE_LINK(next)->prev = hdr;
+    free_foot(heap, hdr);
+}
 
-    }
-    free_hdr->asize = size;
-    return &free_hdr[1];
+/**
+ * Link a free block with no free neighbour into the free list: in address
+ * order with 'free_ordered', else at the head.
+ */
+static
+void free_link(mmal_heap_t* heap, Header* hdr){
+    if(!heap->free_list) return;
+    free_insert(heap, heap->free_ordered ? free_prev(heap, hdr) : NULL, hdr);
 }
 
 /**
- * Free memory block.
- * @param ptr       pointer to previously allocated data
- * @pre ptr != NULL
+ * Replace block 'old' in the free list by 'hdr', which takes its place,
+ * and unlink 'old' when 'hdr' is NULL. A rover on 'old'
+ * moves along.
  */
-void mfree(void* ptr){
-    /// Check function argument
-    if(ptr!=NULL){
-        /// "Take" away the data
-        Header* free_hdr=&((Header*)ptr)[-1];
-        free_hdr->asize=0;
+static
+void free_replace(mmal_heap_t* heap, Header* old, Header* hdr){
+    if(!heap->free_list) return;
 
-        /// Check if headers can merge
-        if(hdr_can_merge(free_hdr,free_hdr->next))
-            hdr_merge(free_hdr,free_hdr->next);
-        if(hdr_can_merge(hdr_get_prev(free_hdr),free_hdr))
-            hdr_merge(hdr_get_prev(free_hdr),free_hdr);
+    Header* prev = FREE_LINK(old)->prev;
+    Header* next = FREE_LINK(old)->next;
+    if(hdr != NULL){
+        FREE_LINK(hdr)->prev = prev;
+        FREE_LINK(hdr)->next = next;
+        free_foot(heap, hdr);
+        next = hdr;
+        prev = hdr;
     }
+    if(FREE_LINK(old)->prev != NULL) FREE_LINK(FREE_LINK(old)->prev)->next = next;
+    else heap->free_head = next;
+    if(FREE_LINK(old)->next != NULL) FREE_LINK(FREE_LINK(old)->next)->prev = prev;
+    if(heap->rover == old) heap->rover = next;
 }
 
 /**
- * Reallocate previously allocated block.
- * @param ptr       pointer to previously allocated data
- * @param size      a new requested size. Size can be greater, equal, or less
- * then size of previously allocated block.
- * @return pointer to reallocated space or NULL if size equals to 0.
- * @post header_of(return pointer)->size == size
+ * Unlink a block from the free list.
  */
-void* mrealloc(void* ptr, size_t size){
-    /// Check function arguments
-    if(ptr == NULL) return NULL;
-    if(size == 0){
-        mfree(ptr);
-        return NULL;
-    }
-
-    /// Check if location has to be changed
-    Header* used_hdr = &((Header*)ptr)[-1];
-    if(size < used_hdr->size){ // 'size' is smaller than is allocated
-        /// Split unused space
-        used_hdr->asize = 0;
-        if(hdr_should_split(used_hdr, size))
-            hdr_split(used_hdr, size);
+static inline
+void free_unlink(mmal_heap_t* heap, Header* hdr){
+    free_replace(heap, hdr, NULL);
+}
 
-        /// Set new 'asize'
-        used_hdr->asize = size;
+/**
+ * Build the free list again from the ring, which is in address order.
+ */
+static
+void free_rebuild(mmal_heap_t* heap){
+    heap->free_head = NULL;
+    heap->rover = NULL;
+    if(!heap->free_list || *heap->first_arena == NULL) return;
+
+    Header* prev = NULL;
+    Header* start = (Header*)(&(*heap->first_arena)[1]);
+    Header* hdr = start;
+    do{
+        if(hdr_asize(hdr) == 0){
+            free_insert(heap, prev, hdr);
+            prev = hdr;
+        }
+        hdr = hdr->next;
+    } while(hdr != start);
+}
+
+/**
+ * Finds a free block that fits to the requested size. First-fit starts
+ * at the beginning of the heap, next-fit (MMAL_OPT_FIT) at the rover where
+ * the last search ended. With MMAL_OPT_FREE_LIST only the free blocks are
+ * visited, otherwise the whole header ring.
+ * @param heap      heap to search
+ * @param size      requested size
+ * @return pointer to the header of the block or NULL if no block is available.
+ * @pre size > 0
+ */
+static
+Header* first_fit(mmal_heap_t* heap, size_t size)
+{
+    /// Check function argument
+    Arena* first = *heap->first_arena;
+    if(size <= 0 || first == NULL) return NULL;
+
+    bool next_fit = heap->fit == MMAL_FIT_NEXT && heap->rover != NULL;
+    Header* appropriate_hdr = NULL;
+    if(heap->free_list){
+        /// Loop through the free list, from the rover to the end and
+        /// from the head to the rover
+        Header* start = next_fit ? heap->rover : heap->free_head;
+        for(Header* hdr = start; hdr != NULL; hdr = FREE_LINK(hdr)->next){
+            if(hdr->size >= size){
+                appropriate_hdr = hdr;
+                break;
+            }
+        }
+        for(Header* hdr = heap->free_head; appropriate_hdr == NULL && hdr != start && hdr != NULL;
+            hdr = FREE_LINK(hdr)->next){
+            if(hdr->size >= size) appropriate_hdr = hdr;
+        }
+    }
+    else{
+        /// Loop through each header and check for size and availability
+        Header* start = next_fit ? heap->rover : (Header*)(&first[1]);
+        Header* hdr = start;
+        do{
+            if(hdr_asize(hdr) == 0 && hdr->size >= size){
+                appropriate_hdr = hdr;
+                break;
+            }
+            hdr = hdr->next;
+        } while(hdr != start);
+    }
+
+    if(appropriate_hdr != NULL && heap->fit == MMAL_FIT_NEXT)
+        heap->rover = appropriate_hdr;
+    return appropriate_hdr;
+}
+
+/**
+ * Merge all adjacent free blocks of a heap in a single pass over the ring.
+ * The first header of the first arena is never merged to its left
+ * neighbour, so it stays in the ring.
+ */
+static
+void heap_coalesce(mmal_heap_t* heap){
+    /// Check function argument
+    if(*heap->first_arena == NULL) return;
+
+    Header* start = (Header*)(&(*heap->first_arena)[1]);
+    Header* hdr = start;
+    do{
+        if(hdr_can_merge(hdr, hdr->next)){
+            while(hdr_can_merge(hdr, hdr->next))
+                heap_merge(heap, hdr, hdr->next);
+            free_info_reset(hdr);
+        }
+        hdr = hdr->next;
+    } while(hdr != start);
+
+    free_rebuild(heap);
+}
+
+/**
+ * Release every block waiting on the quick lists and coalesce the heap.
+ */
+static
+void heap_flush_quick(mmal_heap_t* heap){
+    /// Check if there is anything to do
+    if(heap->quick_bytes == 0) return;
+
+    /// "Take" away the data
+    for(unsigned sc = 0; sc < MMAL_SC_NCLASSES; sc++){
+        Header* hdr = heap->quick[sc];
+        while(hdr != NULL){
+            Header* next = *(Header**)(&hdr[1]);
+            hdr_set_asize(hdr, 0);
+            free_info_reset(hdr);
+            hdr = next;
+        }
+        heap->quick[sc] = NULL;
+    }
+    heap->quick_bytes = 0;
+
+    heap_coalesce(heap);
+}
+
+/**
+ * first_fit() that consolidates the quick lists and searches again on
+ * a miss, before the caller maps a new arena.
+ */
+static
+Header* heap_find(mmal_heap_t* heap, size_t size){
+    Header* hdr = first_fit(heap, size);
+    if(hdr == NULL && heap->quick_bytes != 0){
+        heap_flush_quick(heap);
+        hdr = first_fit(heap, size);
+    }
+    return hdr;
+}
+
+/**
+ * Search the header which is the predecessor to the hdr. Note that if 
+ * @param hdr       successor of the search header
+ * @return pointer to predecessor, hdr if there is just one header.
+ * @post predecessor->next == hdr
+ */
+static
+Header* hdr_get_prev(Header* hdr){
+    /// Check function argument
+    if(hdr == NULL) return hdr;
+
+    /// Loop through 'Header' linked list and find 'hdr' predecessor
+    Header* temp = hdr;
+    while(temp->next != hdr) temp = temp->next;
+    return temp;
+}
+
+/**
+ * Last block of an arena, the one that ends at the end of the arena.
+ * Only the blocks of this arena are visited.
+ */
+static
+Header* arena_last_hdr(Arena* arena){
+    Header* hdr = (Header*)(&arena[1]);
+    while((char*)(&hdr[1]) + hdr->size != (char*)arena + arena->size)
+        hdr = hdr->next;
+    return hdr;
+}
+
+/**
+ * Block of the ring before the first block of the arena following
+ * 'prev' in the arena list: the last block of 'prev', or of the last
+ * arena when 'prev' is NULL.
+ */
+static
+Header* arena_ring_prev(mmal_heap_t* heap, Arena* prev){
+    if(prev == NULL){
+        prev = *heap->first_arena;
+        while(prev->next != NULL) prev = prev->next;
+    }
+    return arena_last_hdr(prev);
+}
+
+/**
+ * Pagemap: pool number (1 + index into hint_heaps) of every page mapped
+ * by a hint pool, 0 for any other page. A two-level radix table over the
+ * 48-bit address space; the root and the leaves are mapped on first use
+ * and only the touched parts take memory.
+ *   address: | root index (18) | leaf index (18) | page offset (12) |
+ */
+#define PAGEMAP_SHIFT     12
+#define PAGEMAP_LEAF_BITS 18
+#define PAGEMAP_ROOT_BITS (48 - PAGEMAP_SHIFT - PAGEMAP_LEAF_BITS)
+#define PAGEMAP_LEAF_LEN  ((size_t)1 << PAGEMAP_LEAF_BITS)
+static uint8_t** pagemap_root = NULL;
+
+/**
+ * Map 'size' bytes for the pagemap.
+ */
+static
+void* pagemap_map(size_t size){
+    void* map = mmap(   NULL, size, PROT_WRITE|PROT_READ,
+                        MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/**
+ * Pool of the page holding 'ptr', 0 if it belongs to no pool.
+ */
+static inline
+unsigned pagemap_get(const void* ptr){
+    uintptr_t page = (uintptr_t)ptr >> PAGEMAP_SHIFT;
+    if(pagemap_root == NULL || (page >> (PAGEMAP_LEAF_BITS + PAGEMAP_ROOT_BITS)) != 0)
+        return 0;
+    uint8_t* leaf = pagemap_root[page >> PAGEMAP_LEAF_BITS];
+    return leaf != NULL ? leaf[page & (PAGEMAP_LEAF_LEN-1)] : 0;
+}
+
+/**
+ * Record the pool of every page of an arena.
+ * @param arena     arena of a hint pool
+ * @param pool      pool number, 0 when the arena is unmapped
+ * @return false if the pagemap cannot be mapped.
+ */
+static
+bool pagemap_set(Arena* arena, unsigned pool){
+    uintptr_t page = (uintptr_t)arena >> PAGEMAP_SHIFT;
+    uintptr_t end  = ((uintptr_t)arena + arena->size - 1) >> PAGEMAP_SHIFT;
+    if((end >> (PAGEMAP_LEAF_BITS + PAGEMAP_ROOT_BITS)) != 0) return false;
+
+    if(pagemap_root == NULL){
+        pagemap_root = pagemap_map(sizeof(uint8_t*) << PAGEMAP_ROOT_BITS);
+        if(pagemap_root == NULL) return false;
+    }
+
+    /// Fill the arena's run of entries leaf by leaf
+    while(page <= end){
+        uint8_t** leaf = &pagemap_root[page >> PAGEMAP_LEAF_BITS];
+        if(*leaf == NULL){
+            if(pool == 0) return true;
+            *leaf = pagemap_map(PAGEMAP_LEAF_LEN);
+            if(*leaf == NULL) return false;
+        }
+        size_t first = page & (PAGEMAP_LEAF_LEN-1);
+        size_t count = PAGEMAP_LEAF_LEN - first;
+        if(count > end - page + 1) count = end - page + 1;
+        memset(&(*leaf)[first], (int)pool, count);
+        page += count;
+    }
+    return true;
+}
+
+/**
+ * Pool number of a heap, 0 if it is no hint pool.
+ */
+static inline
+unsigned heap_pool(mmal_heap_t* heap){
+    if(heap < hint_heaps || heap >= &hint_heaps[HINT_POOLS]) return 0;
+    return (unsigned)(heap - hint_heaps) + 1;
+}
+
+/**
+ * Heap owning a block passed to the default-heap API: its hint pool, or
+ * the default heap.
+ */
+static inline
+mmal_heap_t* heap_owner(void* ptr){
+    unsigned pool = pagemap_get(ptr);
+    return pool != 0 ? &hint_heaps[pool-1] : &default_heap;
+}
+
+/**
+ * Unmap an arena whose only block is free. Its block leaves the header
+ * ring and the arena leaves the arena list.
+ * @param heap      heap owning the arena
+ * @param prev      arena before 'arena' in the list, NULL if it is the first
+ * @param arena     arena to unmap
+ */
+static
+void arena_release(mmal_heap_t* heap, Arena* prev, Arena* arena){
+    /// Unlink the block from the header ring
+    Header* hdr = (Header*)(&arena[1]);
+    Header* ring_prev = NULL;
+    if(prev != NULL || arena->next != NULL){
+        ring_prev = arena_ring_prev(heap, prev);
+        ring_prev->next = hdr->next;
+    }
+    free_unlink(heap, hdr);
+    heap->rover = NULL;
+    if(heap->compact == hdr) heap->compact = ring_prev;
+
+    /// Unlink the arena from the arena list
+    if(prev == NULL) *heap->first_arena = arena->next;
+    else prev->next = arena->next;
+
+    heap->mapped_bytes -= arena->size;
+    if(heap_pool(heap) != 0) pagemap_set(arena, 0);
+    munmap(arena, arena->size);
+}
+
+/**
+ * Unmap the arena holding 'hdr' if it has become free as a whole.
+ * Arenas of a file-backed or shared heap stay.
+ */
+static
+void heap_release_empty(mmal_heap_t* heap, Header* hdr){
+    if(heap->map != NULL) return;
+
+    Arena* prev = NULL;
+    Arena* arena = *heap->first_arena;
+    while(arena != NULL && (uintptr_t)arena + arena->size <= (uintptr_t)hdr){
+        prev = arena;
+        arena = arena->next;
+    }
+    if(arena == NULL) return;
+
+    Header* first = (Header*)(&arena[1]);
+    if(hdr_asize(first) == 0 && first->size == arena->size-sizeof(Arena)-sizeof(Header))
+        arena_release(heap, prev, arena);
+}
+
+/**
+ * Check if mapping 'size' more bytes takes the heap over 'limit'.
+ * @param limit     MMAL_OPT_SOFT_LIMIT or MMAL_OPT_HARD_LIMIT, 0 for none
+ */
+static inline
+bool heap_over_limit(mmal_heap_t* heap, size_t size, size_t limit){
+    return limit != 0 && (heap->mapped_bytes > limit || size > limit - heap->mapped_bytes);
+}
+
+/**
+ * Give memory back right away, whatever the maintenance timers say: every
+ * arena that is free as a whole is unmapped and the pages of the other
+ * free blocks are purged. Used above the soft limit.
+ */
+static
+void heap_relieve(mmal_heap_t* heap){
+    size_t granule = heap->hugepage ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    heap_flush_quick(heap);
+
+    /// Unmap free arenas
+    if(heap->map == NULL){
+        Arena* prev = NULL;
+        Arena* arena = *heap->first_arena;
+        while(arena != NULL){
+            Arena* next = arena->next;
+            Header* hdr = (Header*)(&arena[1]);
+            if(hdr_asize(hdr) == 0 && hdr->size == arena->size-sizeof(Arena)-sizeof(Header))
+                arena_release(heap, prev, arena);
+            else
+                prev = arena;
+            arena = next;
+        }
+    }
+    if(*heap->first_arena == NULL) return;
+
+    /// Purge what is left, blocks purged before are skipped
+    Header* start = (Header*)(&(*heap->first_arena)[1]);
+    Header* hdr = start;
+    do{
+        if(hdr_asize(hdr) == 0 && hdr->size >= FREE_INFO_MIN){
+            FreeInfo* info = FREE_INFO(hdr);
+            bool stamped = info->tag == FREE_INFO_TAG(hdr);
+            if(!stamped || !info->purged){
+                hdr_purge(hdr, granule);
+                if(stamped) info->purged = true;
+            }
+        }
+        hdr = hdr->next;
+    } while(hdr != start);
+}
+
+/**
+ * Map a new arena for the heap and link its only (free) block into the
+ * header ring.
+ * @param heap      heap to grow
+ * @param size      size of data the new block must hold
+ * @return header of the new free block or NULL if error.
+ */
+static
+Header* heap_grow(mmal_heap_t* heap, size_t size){
+    /// A file-backed heap cannot grow beyond its file
+    if(heap->map != NULL) return NULL;
+    if(size > SIZE_MAX - HUGE_PAGE_SIZE - sizeof(Arena) - sizeof(Header)) return NULL;
+
+    /// Check the limits. Above the soft limit memory is given back first,
+    /// the hard limit is never crossed.
+    size_t req_size = size+sizeof(Arena)+sizeof(Header);
+    size_t arena_size = arena_size_of(req_size, heap->hugepage);
+    if(heap_over_limit(heap, arena_size, heap->soft_limit)) heap_relieve(heap);
+    if(heap_over_limit(heap, arena_size, heap->hard_limit)) return NULL;
+
+    Arena* new_arena = arena_alloc(req_size, heap->hugepage);
+    if(new_arena == NULL){
+        fprintf(stderr,"Arena Allocation Failed\n");
+        return NULL;
+    }
+    if(heap_pool(heap) != 0 && !pagemap_set(new_arena, heap_pool(heap))){
+        munmap(new_arena, new_arena->size);
+        return NULL;
+    }
+    heap->mapped_bytes += new_arena->size;
+    Header* free_hdr = (Header*)(&new_arena[1]);
+    hdr_ctor(free_hdr, new_arena->size-sizeof(Arena)-sizeof(Header));
+
+    /// Assign 'Header' linked list pointers. The ring follows the arena
+    /// list, so the block goes after the last block of the previous arena
+    /// (or the last block of all when the arena becomes the first one).
+    Arena* prev_arena = arena_insert(heap, new_arena);
+    if(prev_arena == NULL && new_arena->next == NULL){
+        free_hdr->next = free_hdr;
+    }
+    else{
+        Header* prev_hdr = arena_ring_prev(heap, prev_arena);
+        free_hdr->next = prev_hdr->next;
+        prev_hdr->next = free_hdr;
+    }
+
+    free_link(heap, free_hdr);
+    return free_hdr;
+}
+
+/**
+ * Run the OOM handler of a heap that cannot grow. The heap is unlocked
+ * meanwhile, so the handler may free blocks of it.
+ * @return true if the handler freed memory and the caller should retry.
+ */
+static
+bool heap_oom(mmal_heap_t* heap, size_t size){
+    if(heap->oom == NULL || heap->shared) return false;
+    heap_unlock(heap);
+    bool retry = heap->oom(heap != &default_heap ? heap : NULL, size, heap->oom_arg);
+    heap_lock(heap);
+    return retry;
+}
+
+/**
+ * Find a free block of at least 'size' bytes or map a new one. When the
+ * heap cannot grow, the search is repeated as long as the OOM handler
+ * frees memory.
+ * @return header of the free block or NULL if error.
+ */
+static
+Header* heap_obtain(mmal_heap_t* heap, size_t size){
+    for(;;){
+        Header* hdr = heap_find(heap, size);
+        if(hdr == NULL) hdr = heap_grow(heap, size);
+        if(hdr != NULL || !heap_oom(heap, size)) return hdr;
+    }
+}
+
+/**
+ * Size of the block holding 'size' bytes of data. Small sizes are rounded
+ * up to their size class, others to MMAL_MIN_ALIGN so that every header
+ * and every block stays aligned. 0 if the size is too big.
+ */
+static inline
+size_t block_size_of(size_t size){
+    if(size <= MMAL_SC_MAX_SMALL) return mmal_sc_round(size);
+    if(size > SIZE_MAX - MMAL_MIN_ALIGN) return 0;
+    return (size + MMAL_MIN_ALIGN-1) & ~(size_t)(MMAL_MIN_ALIGN-1);
+}
+
+/**
+ * Give the end of a block holding 'size' bytes of data back to the heap
+ * as a separate free block, if the remainder is worth one.
+ * @param heap      heap owning the block
+ * @param hdr       header of the block, with asize = 0
+ * @param size      size of data the block must keep
+ */
+static
+void heap_trim(mmal_heap_t* heap, Header* hdr, size_t size){
+    size_t block_size = block_size_of(size);
+    if(hdr_should_split(hdr, block_size, heap->min_split))
+        free_link(heap, hdr_split(hdr, block_size));
+}
+
+/**
+ * Take a block of the class of 'block_size' freed in deferred mode, if the
+ * one freed last has its data aligned to 'alignment'.
+ * @param size      requested size for program
+ * @return header of the block, NULL if there is none.
+ */
+static inline
+Header* quick_pop(mmal_heap_t* heap, size_t block_size, size_t size, size_t alignment){
+    if(heap->quick_bytes == 0 || block_size > MMAL_SC_MAX_SMALL) return NULL;
+
+    unsigned sc = mmal_sc_index(block_size);
+    Header* hdr = heap->quick[sc];
+    if(hdr == NULL || (uintptr_t)(&hdr[1]) % alignment != 0) return NULL;
+    heap->quick[sc] = *(Header**)(&hdr[1]);
+    heap->quick_bytes -= hdr->size;
+    hdr_set_asize(hdr, size);
+    return hdr;
+}
+
+/**
+ * Allocate memory from a heap. Use first-fit search of available block.
+ * @param heap      heap to allocate from
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+static
+void* heap_malloc(mmal_heap_t* heap, size_t size){
+    /// Check function argument
+    if(size <= 0) return NULL;
+
+    /// Round small sizes up to their class, so that a freed block fits
+    /// later requests of the same class exactly
+    size_t block_size = block_size_of(size);
+    if(block_size == 0) return NULL;
+
+    /// Reuse a block of the same class freed in deferred mode
+    Header* quick = quick_pop(heap, block_size, size, MMAL_MIN_ALIGN);
+    if(quick != NULL) return &quick[1];
+
+    /// Find free space or create new space
+    Header* free_hdr = heap_obtain(heap, block_size);
+    if(free_hdr == NULL) return NULL;
+
+    /// Split unused space. With MMAL_OPT_SPLIT_BACK the program gets the
+    /// back part and the free block stays where the search finds it first.
+    if(hdr_should_split(free_hdr, block_size, heap->min_split)){
+        if(heap->split_back){
+            Header* rest = free_hdr;
+            free_hdr = hdr_split(rest, rest->size - block_size - sizeof(Header));
+            free_foot(heap, rest);
+            free_info_reset(rest);
+        }
+        else
+            free_replace(heap, free_hdr, hdr_split(free_hdr, block_size));
+    }
+    else{
+        free_unlink(heap, free_hdr);
+    }
+    hdr_set_asize(free_hdr, size);
+    return &free_hdr[1];
+}
+
+/**
+ * Alignments up to this keep the free rest of a block aligned as well, at
+ * the cost of less than 'alignment' bytes per block.
+ */
+#define ALIGN_REST_MAX 64
+
+/**
+ * Allocate memory from a heap with the data aligned to 'alignment'. The
+ * first block that fits is used if its data happens to be aligned. Else a
+ * block is found with enough room to move the data start to the next
+ * aligned address; the skipped front part stays a separate free block.
+ * For small alignments the free rest behind the data is aligned too, so
+ * a run of such requests, like every plain C++ new, splits no front part
+ * after the first one.
+ * @param heap      heap to allocate from
+ * @param alignment power of two
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error, size = 0 or
+ * alignment is not a power of two.
+ */
+/**
+ *    -----+------+------+-----+------+-----------------+----
+ *         |Header|front |     |Header|DDD data DDDD....|
+ *    -----+------+------+-----+------+-----------------+----
+ *                                    ^ aligned
+ */
+static
+void* heap_aligned_alloc(mmal_heap_t* heap, size_t alignment, size_t size){
+    /// Check function arguments
+    if(size == 0 || alignment == 0 || (alignment & (alignment-1)) != 0) return NULL;
+    if(alignment <= MMAL_MIN_ALIGN) return heap_malloc(heap, size);
+    size_t block_size = block_size_of(size);
+    if(block_size == 0 || size > SIZE_MAX - alignment - sizeof(Header) - heap->min_split)
+        return NULL;
+
+    /// Reuse a deferred block of the same class, which is aligned when it
+    /// came from a run of such requests
+    Header* quick = quick_pop(heap, block_size, size, alignment);
+    if(quick != NULL) return &quick[1];
+
+    /// Take the first block that fits if it is aligned already
+    Header* front = NULL;
+    Header* hdr = first_fit(heap, block_size);
+    if(hdr == NULL || (uintptr_t)(&hdr[1]) % alignment != 0){
+        /// Find a block that can hold the data, a front block and the padding
+        hdr = heap_obtain(heap, size + alignment + sizeof(Header) + heap->min_split);
+        if(hdr == NULL) return NULL;
+
+        /// Split off the front part, it keeps at least 'min_split' bytes of data
+        uintptr_t data = (uintptr_t)(&hdr[1]);
+        if(data % alignment != 0){
+            uintptr_t aligned = (data + sizeof(Header) + heap->min_split + alignment-1)
+                                & ~(uintptr_t)(alignment-1);
+            front = hdr;
+            hdr = hdr_split(front, aligned - sizeof(Header) - data);
+            free_foot(heap, front);
+            free_info_reset(front);
+        }
+    }
+
+    /// Keep the data of the free rest aligned for the next request
+    size_t keep = block_size;
+    if(alignment <= ALIGN_REST_MAX)
+        keep += -((uintptr_t)(&hdr[1]) + block_size + sizeof(Header)) & (alignment-1);
+
+    /// Split unused space. The rest takes the place of the block in the
+    /// free list, or follows the front part.
+    Header* rest = hdr_should_split(hdr, keep, heap->min_split) ? hdr_split(hdr, keep) : NULL;
+    if(front != NULL){
+        if(rest != NULL) free_insert(heap, front, rest);
+    }
+    else{
+        free_replace(heap, hdr, rest);
+    }
+    hdr_set_asize(hdr, size);
+    return &hdr[1];
+}
+
+/**
+ * Free an allocated block right away, merging it with free neighbours.
+ * @param heap      heap owning the block
+ * @param free_hdr  header of the block
+ */
+static
+void heap_release(mmal_heap_t* heap, Header* free_hdr){
+    /// "Take" away the data
+    hdr_set_asize(free_hdr, 0);
+
+    /// Find the block before it. The free list finds a free one by its
+    /// boundary tag, without a search; the ring is walked block by block.
+    Header* prev_hdr = heap->free_list ? free_left(free_hdr) : hdr_get_prev(free_hdr);
+    bool merge_prev = prev_hdr != NULL && hdr_can_merge(prev_hdr,free_hdr);
+    Header* next_hdr = hdr_can_merge(free_hdr,free_hdr->next) ? free_hdr->next : NULL;
+
+    /// Check if headers can merge. The block is merged into its left
+    /// neighbour, takes the place of its right neighbour in the free list,
+    /// or is linked on its own.
+    if(merge_prev){
+        if(next_hdr != NULL){
+            free_unlink(heap,next_hdr);
+            heap_merge(heap,free_hdr,next_hdr);
+        }
+        heap_merge(heap,prev_hdr,free_hdr);
+        free_hdr = prev_hdr;
+    }
+    else if(next_hdr != NULL){
+        free_replace(heap,next_hdr,free_hdr);
+        heap_merge(heap,free_hdr,next_hdr);
+    }
+    else{
+        free_link(heap,free_hdr);
+    }
+    free_foot(heap,free_hdr);
+    free_info_reset(free_hdr);
+}
+
+/**
+ * Free memory block of a heap.
+ * @param heap      heap owning the block
+ * @param ptr       pointer to previously allocated data
+ * @pre ptr != NULL
+ */
+static
+void heap_free(mmal_heap_t* heap, void* ptr){
+    /// Check function argument
+    if(ptr!=NULL){
+        Header* free_hdr=&((Header*)ptr)[-1];
+
+        /// Deferred mode: park small blocks on the quick list of the
+        /// largest class they hold. Aligned blocks keep some padding and
+        /// are bigger than their class.
+        if(heap->defer_bytes != 0 && free_hdr->size <= MMAL_SC_MAX_SMALL){
+            unsigned sc = mmal_sc_index(free_hdr->size);
+            if(mmal_sc_info[sc].size > free_hdr->size) sc--;
+            hdr_set_asize(free_hdr, ASIZE_QUICK);
+            *(Header**)ptr = heap->quick[sc];
+            heap->quick[sc] = free_hdr;
+            heap->quick_bytes += free_hdr->size;
+            if(heap->quick_bytes > heap->defer_bytes) heap_flush_quick(heap);
+            return;
+        }
+
+        heap_release(heap, free_hdr);
+    }
+}
+
+/**
+ * Grow an allocated block in place, by merging it with the free block
+ * that follows it. The block is never moved.
+ * @param heap      heap owning the block
+ * @param used_hdr  header of the allocated block
+ * @param size      a new requested size
+ * @return true if the block now holds 'size' bytes, false if it is unchanged.
+ */
+static
+bool heap_try_expand(mmal_heap_t* heap, Header* used_hdr, size_t size){
+    /// Check if current header has enough space
+    if(used_hdr->size >= size){
+        hdr_set_asize(used_hdr, size);
+        return true;
+    }
+
+    /// Check if next header is free and has enough space. The block looks
+    /// free to the merge until its new size is set.
+    size_t old_asize = used_hdr->asize;
+    used_hdr->asize &= ASIZE_PREV;
+    if( hdr_asize(used_hdr->next) == 0
+        && used_hdr->next->size+sizeof(Header) >= size-used_hdr->size
+        && hdr_can_merge(used_hdr, used_hdr->next)){
+        /// True: Merge headers
+        free_unlink(heap, used_hdr->next);
+        heap_merge(heap, used_hdr, used_hdr->next);
+
+        /// Split unused space
+        heap_trim(heap, used_hdr, size);
+
+        /// Set new 'asize'
+        hdr_set_asize(used_hdr, size);
+        return true;
+    }
+    used_hdr->asize = old_asize;
+    return false;
+}
+
+/**
+ * Reallocate previously allocated block of a heap.
+ * @param heap      heap owning the block
+ * @param ptr       pointer to previously allocated data
+ * @param size      a new requested size. Size can be greater, equal, or less
+ * then size of previously allocated block.
+ * @return pointer to reallocated space or NULL if size equals to 0.
+ * @post header_of(return pointer)->size == size
+ */
+static
+void* heap_realloc(mmal_heap_t* heap, void* ptr, size_t size){
+    /// Check function arguments
+    if(ptr == NULL) return NULL;
+    if(size == 0){
+        heap_free(heap, ptr);
+        return NULL;
+    }
+
+    /// Check if location has to be changed
+    Header* used_hdr = &((Header*)ptr)[-1];
+    if(size < used_hdr->size){ // 'size' is smaller than is allocated
+        /// Split unused space
+        used_hdr->asize &= ASIZE_PREV;
+        heap_trim(heap, used_hdr, size);
+
+        /// Set new 'asize'
+        hdr_set_asize(used_hdr, size);
         return ptr;
     }
-    else if(size == used_hdr->size){ // 'size' is equal to already allocated size 
-        return ptr;
+    else if(size == used_hdr->size){ // 'size' is equal to already allocated size 
+        hdr_set_asize(used_hdr, size);
+        return ptr;
+    }
+    else{ // 'size' is bigger than is allocated
+        /// Check if next header is free and has enough space
+        if(heap_try_expand(heap, used_hdr, size))
+            return ptr;
+
+        /// Check if previous header is free and, together with the next
+        /// one, has enough space. The whole old block is kept, the program
+        /// may use more than asize (see mmal_usable_size).
+        size_t old_size = used_hdr->size;
+        size_t old_asize = used_hdr->asize;
+        used_hdr->asize &= ASIZE_PREV;
+        Header* prev_hdr = heap->free_list ? free_left(used_hdr) : hdr_get_prev(used_hdr);
+        bool next_free = hdr_can_merge(used_hdr, used_hdr->next);
+        size_t avail = used_hdr->size;
+        if(next_free) avail += used_hdr->next->size+sizeof(Header);
+        if( prev_hdr != NULL && hdr_can_merge(prev_hdr, used_hdr)
+            && prev_hdr->size+sizeof(Header)+avail >= size){
+            /// True: Merge headers and move the data to the left
+            if(next_free){
+                free_unlink(heap, used_hdr->next);
+                heap_merge(heap, used_hdr, used_hdr->next);
+            }
+            free_unlink(heap, prev_hdr);
+            heap_merge(heap, prev_hdr, used_hdr);
+            memmove(&prev_hdr[1], &used_hdr[1], old_size);
+
+            /// Split unused space
+            heap_trim(heap, prev_hdr, size);
+
+            /// Set new 'asize'
+            hdr_set_asize(prev_hdr, size);
+            return &prev_hdr[1];
+        }
+        else{
+            /// False: Find or allocate new space. The block must look
+            /// allocated again, the search may consolidate the heap.
+            used_hdr->asize = old_asize;
+            void* new_ptr = heap_malloc(heap, size);
+            if(new_ptr == NULL) return NULL;
+            Header* new_hdr = &((Header*)new_ptr)[-1];
+
+            /// Copy old data into new space
+            block_copy(heap, &new_hdr[1], &used_hdr[1], old_size);
+
+            /// Free old space
+            heap_free(heap, &used_hdr[1]);
+            return &new_hdr[1];
+        }
+    }
+}
+
+/**
+ * Return the heap serving a lifetime hint.
+ * @param hints     MMAL_SHORT_LIVED or MMAL_LONG_LIVED, anything else
+ *                  selects the default heap
+ */
+static inline
+mmal_heap_t* hint_heap(unsigned hints){
+    switch(hints & (MMAL_SHORT_LIVED|MMAL_LONG_LIVED)){
+        case MMAL_SHORT_LIVED:
+            return &hint_heaps[POOL_SHORT];
+        case MMAL_LONG_LIVED:
+            return &hint_heaps[POOL_LONG];
+    }
+    return &default_heap;
+}
+
+/**
+ * Allocate memory from the pool of a lifetime hint.
+ * @param size      requested size for program
+ * @param hints     MMAL_SHORT_LIVED or MMAL_LONG_LIVED, anything else
+ *                  allocates from the default heap
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+void* mmal_malloc_hint(size_t size, unsigned hints){
+    mmal_heap_t* heap = hint_heap(hints);
+    heap_lock(heap);
+    void* ptr = heap_malloc(heap, size);
+    heap_unlock(heap);
+    return ptr;
+}
+
+/**
+ * Allocation sites (mmal_site_learn()). A site is the return address of
+ * an mmalloc(), mmal_malloc_usable() or mmal_aligned_alloc() call. One
+ * call in 'site_rate' is sampled: the block is remembered with its site
+ * and the allocation clock, the bytes these calls have handed out so far. A sample freed within SITE_SHORT_BYTES of the
+ * clock counts as short-lived, one still alive after SITE_LONG_BYTES as
+ * long-lived. Once a site has enough samples and most of them agree, its
+ * blocks are allocated from the matching hint pool.
+ *   sites:        open addressing on the return address
+ *   site_samples: direct mapped on the block address, a sample whose
+ *                 slot is taken is skipped
+ */
+typedef struct site Site;
+struct site {
+    /// Return address of the call, NULL for an empty slot
+    const void* pc;
+
+    /// Samples freed early and samples that lived long
+    uint32_t short_count;
+    uint32_t long_count;
+
+    /// MMAL_SHORT_LIVED, MMAL_LONG_LIVED or 0 while undecided
+    unsigned hints;
+};
+
+typedef struct site_sample SiteSample;
+struct site_sample {
+    void* ptr;
+    Site* site;
+    uint64_t birth;
+};
+
+#define SITE_BITS         12
+#define SITE_MAX          ((size_t)1 << SITE_BITS)
+#define SAMPLE_BITS       10
+#define SAMPLE_MAX        ((size_t)1 << SAMPLE_BITS)
+/// Lifetimes on the allocation clock.
+#define SITE_SHORT_BYTES  ((uint64_t)1 << 20)
+#define SITE_LONG_BYTES   ((uint64_t)64 << 20)
+/// Samples a site needs before it is placed; counts are halved past the cap.
+#define SITE_MIN_SAMPLES  4
+#define SITE_MAX_SAMPLES  (1u << 16)
+
+static Site sites[SITE_MAX];
+static size_t site_count = 0;
+static SiteSample site_samples[SAMPLE_MAX];
+static size_t site_live = 0;
+static size_t site_sampled = 0;
+/// Sampling interval, 0 when not learning.
+static unsigned site_rate = 0;
+static unsigned site_countdown = 0;
+static uint64_t site_clock = 0;
+/// Some site has a verdict: mmalloc() has to look its site up.
+static bool site_placing = false;
+
+/**
+ * Fibonacci hash of an address to 'bits' bits.
+ */
+static inline
+size_t site_hash(const void* ptr, unsigned bits){
+    return (size_t)(((uintptr_t)ptr >> 4) * UINT64_C(0x9E3779B97F4A7C15) >> (64 - bits));
+}
+
+/**
+ * Find a site in the table.
+ * @param pc        return address of the call
+ * @param add       add the site if it is not there yet
+ * @return the site or NULL if it is unknown or the table is full.
+ */
+static
+Site* site_find(const void* pc, bool add){
+    for(size_t i = site_hash(pc, SITE_BITS);; i = (i+1) & (SITE_MAX-1)){
+        if(sites[i].pc == pc) return &sites[i];
+        if(sites[i].pc == NULL){
+            /// Keep a quarter free so that misses end quickly
+            if(!add || site_count >= SITE_MAX/4*3) return NULL;
+            sites[i].pc = pc;
+            site_count++;
+            return &sites[i];
+        }
+    }
+}
+
+/**
+ * Decide the pool of a site from its samples.
+ */
+static
+void site_judge(Site* site){
+    /// Let the recent behaviour of the site outweigh the old one
+    if(site->short_count + site->long_count > SITE_MAX_SAMPLES){
+        site->short_count /= 2;
+        site->long_count  /= 2;
+    }
+
+    uint32_t n = site->short_count + site->long_count;
+    site->hints = 0;
+    if(n < SITE_MIN_SAMPLES) return;
+    if(site->short_count*8 >= n*7)
+        site->hints = MMAL_SHORT_LIVED;
+    else if(site->long_count*8 >= n*7)
+        site->hints = MMAL_LONG_LIVED;
+    if(site->hints != 0) site_placing = true;
+}
+
+/**
+ * Count a sample ending now, freed or judged long-lived, and forget it.
+ */
+static
+void site_end(SiteSample* sample){
+    uint64_t life = site_clock - sample->birth;
+    if(life < SITE_SHORT_BYTES)
+        sample->site->short_count++;
+    else if(life >= SITE_LONG_BYTES)
+        sample->site->long_count++;
+    site_judge(sample->site);
+
+    sample->ptr = NULL;
+    site_live--;
+}
+
+/**
+ * End all samples that have lived long already; their sites need not
+ * wait for the blocks to be freed.
+ */
+static
+void site_age(void){
+    for(size_t i = 0; i < SAMPLE_MAX; i++){
+        SiteSample* sample = &site_samples[i];
+        if(sample->ptr != NULL && site_clock - sample->birth >= SITE_LONG_BYTES)
+            site_end(sample);
+    }
+}
+
+/**
+ * Routing sites to the hint pools moves mmalloc() calls out of the default
+ * heap, past its limits, its OOM handler and its maintenance thread. It
+ * stops while any of them is set.
+ */
+static inline
+bool site_can_route(void){
+    return  default_heap.soft_limit == 0 && default_heap.hard_limit == 0
+            && default_heap.oom == NULL && !default_heap.maint_running;
+}
+
+/**
+ * Remember a block allocated by a sampled call.
+ * @param ptr       the block
+ * @param pc        return address of the call
+ */
+static
+void site_sample(void* ptr, const void* pc){
+    SiteSample* sample = &site_samples[site_hash(ptr, SAMPLE_BITS)];
+    Site* site = site_find(pc, true);
+    if(site == NULL || sample->ptr != NULL) return;
+    *sample = (SiteSample){ .ptr = ptr, .site = site, .birth = site_clock };
+    site_live++;
+
+    /// Samples that never get freed must still count
+    if(++site_sampled % (SAMPLE_MAX/4) == 0) site_age();
+}
+
+/**
+ * mmalloc() or mmal_aligned_alloc() while sites are learned or placed.
+ * The site tables are kept under the lock of the default heap.
+ * @param size      requested size for program
+ * @param alignment power of two, MMAL_MIN_ALIGN for mmalloc()
+ * @param pc        return address of the call
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+static
+void* site_malloc(size_t size, size_t alignment, const void* pc){
+    /// Allocate from the pool the site has been placed in
+    heap_lock(&default_heap);
+    Site* site = site_placing && site_can_route() ? site_find(pc, false) : NULL;
+    unsigned hints = site != NULL ? site->hints : 0;
+    heap_unlock(&default_heap);
+    mmal_heap_t* heap = hint_heap(hints);
+    heap_lock(heap);
+    void* ptr = heap_aligned_alloc(heap, alignment, size);
+    heap_unlock(heap);
+    if(ptr == NULL) return NULL;
+
+    /// Advance the clock and sample every 'site_rate'th call
+    heap_lock(&default_heap);
+    if(site_rate != 0){
+        site_clock += size;
+        if(--site_countdown == 0){
+            site_countdown = site_rate;
+            site_sample(ptr, pc);
+        }
+    }
+    heap_unlock(&default_heap);
+    return ptr;
+}
+
+/**
+ * Follow a sampled block through mrealloc().
+ * @param ptr       the block before
+ * @param new_ptr   the block after, NULL if it was freed
+ */
+static
+void site_move(void* ptr, void* new_ptr){
+    SiteSample* sample = &site_samples[site_hash(ptr, SAMPLE_BITS)];
+    if(ptr == NULL || sample->ptr != ptr || new_ptr == ptr) return;
+    if(new_ptr == NULL){
+        site_end(sample);
+        return;
+    }
+
+    /// Move the sample to the slot of the new address, or drop it
+    SiteSample* moved = &site_samples[site_hash(new_ptr, SAMPLE_BITS)];
+    if(moved->ptr == NULL){
+        *moved = *sample;
+        moved->ptr = new_ptr;
+    }
+    else site_live--;
+    sample->ptr = NULL;
+}
+
+/**
+ * Allocate memory. Use first-fit search of available block.
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+void* mmalloc(size_t size){
+    if(site_rate != 0 || site_placing)
+        return site_malloc(size, MMAL_MIN_ALIGN, __builtin_return_address(0));
+
+    heap_lock(&default_heap);
+    void* ptr = heap_malloc(&default_heap, size);
+    heap_unlock(&default_heap);
+    return ptr;
+}
+
+/**
+ * Free a block of the default heap or of a hint pool, without looking at
+ * the site samples.
+ */
+static
+void owner_free(void* ptr){
+    /// Blocks of mmal_malloc_hint() go back to their pool. An emptied
+    /// short-lived arena is unmapped unless it is the last one.
+    mmal_heap_t* heap = heap_owner(ptr);
+    heap_lock(heap);
+    heap_free(heap, ptr);
+    if(heap == &hint_heaps[POOL_SHORT] && (*heap->first_arena)->next != NULL)
+        heap_release_empty(heap, &((Header*)ptr)[-1]);
+    heap_unlock(heap);
+}
+
+/**
+ * Free memory block.
+ * @param ptr       pointer to previously allocated data
+ * @pre ptr != NULL
+ */
+void mfree(void* ptr){
+    if(site_live != 0){
+        heap_lock(&default_heap);
+        site_move(ptr, NULL);
+        heap_unlock(&default_heap);
+    }
+    owner_free(ptr);
+}
+
+/**
+ * Allocate memory aligned to 'alignment' from the default heap, or from
+ * the pool its site has been placed in.
+ */
+void* mmal_aligned_alloc(size_t alignment, size_t size){
+    if(site_rate != 0 || site_placing)
+        return site_malloc(size, alignment, __builtin_return_address(0));
+
+    return mmal_heap_aligned_alloc(&default_heap, alignment, size);
+}
+
+/**
+ * Return the number of bytes the program may use in an allocated block.
+ * @param ptr       pointer to previously allocated data
+ * @return size of the block, 0 if ptr is NULL.
+ */
+size_t mmal_usable_size(void* ptr){
+    /// Check function argument
+    if(ptr == NULL) return 0;
+
+    return (&((Header*)ptr)[-1])->size;
+}
+
+/**
+ * Allocate memory and report the whole usable size of the block.
+ * @param size      requested size for program
+ * @param actual    stores the usable size if not NULL
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+void* mmal_malloc_usable(size_t size, size_t* actual){
+    void* ptr = site_rate != 0 || site_placing
+                ? site_malloc(size, MMAL_MIN_ALIGN, __builtin_return_address(0))
+                : mmalloc(size);
+    if(ptr == NULL) return NULL;
+
+    if(actual != NULL) *actual = (&((Header*)ptr)[-1])->size;
+    return ptr;
+}
+
+/**
+ * Grow a block of the default heap without moving it.
+ */
+bool mmal_try_expand(void* ptr, size_t size){
+    /// Check function arguments
+    if(ptr == NULL || size == 0) return false;
+
+    mmal_heap_t* heap = heap_owner(ptr);
+    heap_lock(heap);
+    bool expanded = heap_try_expand(heap, &((Header*)ptr)[-1], size);
+    heap_unlock(heap);
+    return expanded;
+}
+
+/**
+ * Free memory block whose size the caller knows. 'size' is only checked,
+ * the free path does not use it: a block can be bigger than the class of
+ * its size (a remainder too small to split, the padding of an aligned
+ * block), so the quick list it goes to depends on the header anyway.
+ * @param ptr       pointer to previously allocated data
+ * @param size      size the block was allocated (or last reallocated) with,
+ *                  up to its usable size
+ * @pre asize <= size <= usable size; checked by assert only
+ */
+void mfree_sized(void* ptr, size_t size){
+    /// Check function argument
+    if(ptr == NULL) return;
+    assert(hdr_asize(&((Header*)ptr)[-1]) <= size && size <= (&((Header*)ptr)[-1])->size);
+    (void)size;
+
+    mfree(ptr);
+}
+
+/**
+ * Reallocate previously allocated block.
+ * @param ptr       pointer to previously allocated data
+ * @param size      a new requested size. Size can be greater, equal, or less
+ * then size of previously allocated block.
+ * @return pointer to reallocated space or NULL if size equals to 0.
+ * @post header_of(return pointer)->size == size
+ */
+void* mrealloc(void* ptr, size_t size){
+    mmal_heap_t* heap = heap_owner(ptr);
+    heap_lock(heap);
+    void* new_ptr = heap_realloc(heap, ptr, size);
+    heap_unlock(heap);
+    /// A failed move leaves the block where it was
+    if(site_live != 0 && (new_ptr != NULL || size == 0)){
+        heap_lock(&default_heap);
+        site_move(ptr, new_ptr);
+        heap_unlock(&default_heap);
+    }
+    return new_ptr;
+}
+
+/**
+ * Create a new empty heap. The heap structure itself is allocated from
+ * the default heap, arenas are mapped on the first allocation.
+ * @return the new heap or NULL if error.
+ */
+mmal_heap_t* mmal_heap_create(void){
+    mmal_heap_t* heap = mmalloc(sizeof(mmal_heap_t));
+    if(heap == NULL) return NULL;
+
+    *heap = (mmal_heap_t)HEAP_INIT(&heap->arenas);
+    pthread_mutex_init(&heap->lock, NULL);
+    pthread_cond_init(&heap->maint_wake, NULL);
+    return heap;
+}
+
+/**
+ * Handle of a movable block (mmal_halloc()). The block starts with a
+ * pointer back to its handle, so the compactor can tell movable blocks
+ * from others and update the handle when it moves one:
+ *   +------+-------+---------------------------+
+ *   |Header|Handle*|DDD program data DDDDD.....|
+ *   +------+-------+---------------------------+
+ *          ^ block ^ mmal_hlock()
+ */
+typedef struct mmal_handle Handle;
+struct mmal_handle {
+    /// Data of the block, NULL if the slot is free.
+    void *block;
+
+    /// Heap owning the block.
+    mmal_heap_t *heap;
+
+    /// mmal_hlock() calls not matched by mmal_hunlock() yet, the block
+    /// does not move while it is locked.
+    size_t locks;
+};
+
+/// Space of the handle pointer in front of the program data.
+#define HANDLE_PREFIX sizeof(Handle*)
+
+/// Number of handles, the table is mapped once and never moves.
+#ifndef MMAL_HANDLE_MAX
+#define MMAL_HANDLE_MAX (1u << 20)
+#endif
+
+/**
+ * Table of all handles of the process and the bitmap of the used slots,
+ * mapped on the first mmal_halloc(). Slots are taken and returned under
+ * 'handle_lock', heaps used from different threads share the table.
+ * A second level bitmap marks the full words of the first, so a nearly
+ * full table is searched a group of 64 words at a time:
+ *   handle_full: | group 0 | group 1 | ...     one bit per full word
+ *   handle_used: | word 0 ... word 63 | ...    one bit per used slot
+ */
+static Handle* handle_table = NULL;
+static uint64_t* handle_used = NULL;
+static uint64_t* handle_full = NULL;
+/// Word of 'handle_used' the next slot search starts from.
+static size_t handle_hint = 0;
+static pthread_mutex_t handle_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define HANDLE_WORDS  (MMAL_HANDLE_MAX / 64)
+#define HANDLE_GROUPS ((HANDLE_WORDS + 63) / 64)
+
+/**
+ * Take a free handle slot.
+ * @return the slot or NULL if the table is full or cannot be mapped.
+ */
+static
+Handle* handle_alloc(void){
+    Handle* handle = NULL;
+    pthread_mutex_lock(&handle_lock);
+
+    /// Map the table and its bitmaps in one go, pages are touched lazily
+    if(handle_table == NULL){
+        size_t size =   MMAL_HANDLE_MAX*sizeof(Handle)
+                      + (HANDLE_WORDS + HANDLE_GROUPS)*sizeof(uint64_t);
+        void* map = mmap(   NULL, size, PROT_WRITE|PROT_READ,
+                            MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+        if(map == MAP_FAILED) goto out;
+        handle_table = map;
+        handle_used = (uint64_t*)(&handle_table[MMAL_HANDLE_MAX]);
+        handle_full = &handle_used[HANDLE_WORDS];
+
+        /// Words past the end of the last group never have a free slot
+        if(HANDLE_WORDS % 64 != 0)
+            handle_full[HANDLE_GROUPS-1] = ~(uint64_t)0 << (HANDLE_WORDS % 64);
+        if(!simd_ready) simd_init();
+    }
+
+    /// Find a group with a word not full, from the hint around the table
+    size_t start = handle_hint / 64;
+    size_t group = bitmap_scan(handle_full, start, HANDLE_GROUPS);
+    if(group == HANDLE_GROUPS){
+        group = bitmap_scan(handle_full, 0, start);
+        if(group == start) goto out;
+    }
+
+    /// Take the first clear bit of its first word not full
+    size_t word = group*64 + (size_t)__builtin_ctzll(~handle_full[group]);
+    unsigned bit = (unsigned)__builtin_ctzll(~handle_used[word]);
+    handle_used[word] |= (uint64_t)1 << bit;
+    if(~handle_used[word] == 0) handle_full[group] |= (uint64_t)1 << (word % 64);
+    handle_hint = word;
+    handle = &handle_table[word*64 + bit];
+out:
+    pthread_mutex_unlock(&handle_lock);
+    return handle;
+}
+
+/**
+ * Return a handle slot to the table.
+ */
+static
+void handle_free(Handle* handle){
+    size_t slot = (size_t)(handle - handle_table);
+    pthread_mutex_lock(&handle_lock);
+    handle->block = NULL;
+    handle_used[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+    handle_full[slot / 4096] &= ~((uint64_t)1 << (slot / 64 % 64));
+    pthread_mutex_unlock(&handle_lock);
+}
+
+/**
+ * Return every handle slot of a heap being destroyed to the table. The
+ * blocks go away with the arenas of the heap.
+ */
+static
+void handle_free_heap(mmal_heap_t* heap){
+    if(handle_table == NULL) return;
+
+    pthread_mutex_lock(&handle_lock);
+    for(size_t word = 0; word < HANDLE_WORDS; word++){
+        for(uint64_t used = handle_used[word]; used != 0; used &= used-1){
+            size_t slot = word*64 + (size_t)__builtin_ctzll(used);
+            if(handle_table[slot].heap != heap) continue;
+            handle_table[slot].block = NULL;
+            handle_table[slot].heap  = NULL;
+            handle_used[word] &= ~((uint64_t)1 << (slot % 64));
+            handle_full[word / 64] &= ~((uint64_t)1 << (word % 64));
+        }
+    }
+    pthread_mutex_unlock(&handle_lock);
+}
+
+/**
+ * Release a heap. Every arena of the heap is unmapped, blocks inside do
+ * not need to be freed separately, handles of its blocks are returned to
+ * the handle table. A file-backed heap is written back and closed, its
+ * blocks stay in the file.
+ * @param heap      heap created by mmal_heap_create() or mmal_heap_open_file()
+ */
+void mmal_heap_destroy(mmal_heap_t* heap){
+    /// Check function argument
+    if(heap == NULL || heap == &default_heap) return;
+
+    /// A shared heap is only unmapped from this process
+    if(heap->shared){
+        munmap(heap->map, heap->map_size);
+        return;
+    }
+    mmal_heap_maintenance_stop(heap);
+    handle_free_heap(heap);
+
+    /// Unmap all arenas
+    if(heap->map != NULL){
+        heap_flush_quick(heap);
+        msync(heap->map, heap->map_size, MS_SYNC);
+        munmap(heap->map, heap->map_size);
+        close(heap->fd);
+    }
+    else{
+        arena_unmap_list(*heap->first_arena);
+    }
+
+    pthread_cond_destroy(&heap->maint_wake);
+    pthread_mutex_destroy(&heap->lock);
+    mfree(heap);
+}
+
+void* mmal_heap_malloc(mmal_heap_t* heap, size_t size){
+    heap = heap_of(heap);
+    heap_lock(heap);
+    void* ptr = heap_malloc(heap, size);
+    heap_unlock(heap);
+    return ptr;
+}
+
+void mmal_heap_free(mmal_heap_t* heap, void* ptr){
+    if(heap == NULL){
+        mfree(ptr);
+        return;
+    }
+    heap_lock(heap);
+    heap_free(heap, ptr);
+    heap_unlock(heap);
+}
+
+void* mmal_heap_realloc(mmal_heap_t* heap, void* ptr, size_t size){
+    if(heap == NULL) return mrealloc(ptr, size);
+    heap_lock(heap);
+    ptr = heap_realloc(heap, ptr, size);
+    heap_unlock(heap);
+    return ptr;
+}
+
+void* mmal_heap_aligned_alloc(mmal_heap_t* heap, size_t alignment, size_t size){
+    heap = heap_of(heap);
+    heap_lock(heap);
+    void* ptr = heap_aligned_alloc(heap, alignment, size);
+    heap_unlock(heap);
+    return ptr;
+}
+
+/**
+ * Set an option of a heap. MMAL_OPT_HUGEPAGE affects arenas mapped
+ * afterwards, the others the next maintenance pass.
+ * @param heap      heap to configure
+ * @param option    one of MMAL_OPT_*
+ * @param value     new value of the option
+ * @return false if the option or the value is invalid.
+ */
+static
+bool heap_setopt(mmal_heap_t* heap, int option, size_t value){
+    bool valid = true;
+    heap_lock(heap);
+    switch(option){
+        case MMAL_OPT_HUGEPAGE:
+            if(value > 1) valid = false;
+            else heap->hugepage = value;
+            break;
+        case MMAL_OPT_DECAY_MS:
+            heap->decay_ms = value;
+            break;
+        case MMAL_OPT_RETAIN_MS:
+            heap->retain_ms = value;
+            break;
+        case MMAL_OPT_SPARE_BYTES:
+            heap->spare_bytes = value;
+            break;
+        case MMAL_OPT_MIN_SPLIT:
+            heap->min_split = value < sizeof(FreeLink) ? sizeof(FreeLink)
+                            : (value + MMAL_MIN_ALIGN-1) & ~(size_t)(MMAL_MIN_ALIGN-1);
+            break;
+        case MMAL_OPT_SPLIT_BACK:
+            if(value > 1) valid = false;
+            else heap->split_back = value;
+            break;
+        case MMAL_OPT_FIT:
+            if(value != MMAL_FIT_FIRST && value != MMAL_FIT_NEXT) valid = false;
+            else heap->fit = (int)value;
+            heap->rover = NULL;
+            break;
+        case MMAL_OPT_FREE_LIST:
+            if(value > 2) valid = false;
+            else{
+                heap->free_list = value != 0;
+                heap->free_ordered = value == 2;
+            }
+            free_rebuild(heap);
+            break;
+        case MMAL_OPT_DEFER_BYTES:
+            heap->defer_bytes = value;
+            if(heap->quick_bytes > value) heap_flush_quick(heap);
+            break;
+        case MMAL_OPT_COMPACT_BYTES:
+            heap->compact_bytes = value;
+            break;
+        case MMAL_OPT_STREAM_COPY:
+            heap->stream_copy = value;
+            break;
+        case MMAL_OPT_SOFT_LIMIT:
+            heap->soft_limit = value;
+            if(heap_over_limit(heap, 0, value)) heap_relieve(heap);
+            break;
+        case MMAL_OPT_HARD_LIMIT:
+            heap->hard_limit = value;
+            break;
+        default:
+            valid = false;
+            break;
+    }
+    heap_unlock(heap);
+    return valid;
+}
+
+bool mmal_heap_setopt(mmal_heap_t* heap, int option, size_t value){
+    heap = heap_of(heap);
+    if(!heap_setopt(heap, option, value)) return false;
+
+    /// The hint pools follow the options of the default heap. Its limits
+    /// stay its own, site_can_route() keeps mmalloc() out of the pools
+    /// while they are set.
+    if(heap == &default_heap && option != MMAL_OPT_SOFT_LIMIT && option != MMAL_OPT_HARD_LIMIT){
+        for(size_t i = 0; i < HINT_POOLS; i++)
+            heap_setopt(&hint_heaps[i], option, value);
+    }
+    return true;
+}
+
+bool mmal_heap_set_oom_handler(mmal_heap_t* heap, mmal_oom_handler_t handler, void* arg){
+    heap = heap_of(heap);
+
+    /// The structure of a shared heap is seen by every process attached,
+    /// a function pointer of one of them means nothing to the others
+    if(heap->shared) return false;
+
+    heap_lock(heap);
+    heap->oom = handler;
+    heap->oom_arg = arg;
+    heap_unlock(heap);
+    return true;
+}
+
+size_t mmal_heap_mapped_bytes(mmal_heap_t* heap){
+    heap = heap_of(heap);
+    heap_lock(heap);
+    size_t bytes = heap->mapped_bytes;
+    heap_unlock(heap);
+    return bytes;
+}
+
+/**
+ * Allocate 'n' blocks of equal size from a heap. The blocks are carved
+ * one after another from a single free block (or a single new arena), so
+ * the heap is searched only once for the whole batch.
+ * @param heap      heap to allocate from
+ * @param size      requested size of every block
+ * @param n         number of blocks
+ * @param ptrs      array of 'n' pointers to store the blocks to
+ * @return number of allocated blocks, less than 'n' if error.
+ */
+static
+size_t heap_malloc_batch(mmal_heap_t* heap, size_t size, size_t n, void** ptrs){
+    /// Check function arguments
+    if(size == 0 || n == 0 || ptrs == NULL) return 0;
+    size_t block_size = block_size_of(size);
+    if(block_size == 0) return 0;
+
+    /// Space for the whole batch including headers of all but the first block
+    size_t span = 0;
+    if(__builtin_mul_overflow(block_size+sizeof(Header), n, &span)){
+        span = 0;
+    }
+    else{
+        span -= sizeof(Header);
+    }
+
+    Header* hdr = NULL;
+    if(span != 0){
+        hdr = heap_find(heap, span);
+        if(hdr == NULL) hdr = heap_grow(heap, span);
+    }
+    if(hdr == NULL){
+        /// Fall back to separate allocations
+        size_t i;
+        for(i = 0; i < n; i++){
+            ptrs[i] = heap_malloc(heap, size);
+            if(ptrs[i] == NULL) break;
+        }
+        return i;
+    }
+
+    /// Carve the blocks
+    free_unlink(heap, hdr);
+    for(size_t i = 0; i < n; i++){
+        if(i < n-1) hdr_split(hdr, block_size);
+        else heap_trim(heap, hdr, block_size);
+        hdr_set_asize(hdr, size);
+        ptrs[i] = &hdr[1];
+        hdr = hdr->next;
+    }
+    return n;
+}
+
+/**
+ * Free an array of blocks of a heap. Every block is merged with its free
+ * neighbours like in mfree, so the cost follows the batch, not the heap.
+ * @param heap      heap owning the blocks
+ * @param ptrs      pointers to previously allocated data, NULL entries are skipped
+ * @param n         number of pointers
+ */
+static
+void heap_free_batch(mmal_heap_t* heap, void** ptrs, size_t n){
+    /// Check function arguments
+    if(ptrs == NULL) return;
+
+    /// Blocks of the hint pools go back to their owner, even while the
+    /// default heap has no arena of its own
+    for(size_t i = 0; i < n; i++){
+        if(ptrs[i] == NULL) continue;
+        if(heap == &default_heap && site_live != 0) site_move(ptrs[i], NULL);
+        if(heap == &default_heap && heap_owner(ptrs[i]) != heap){
+            owner_free(ptrs[i]);
+            continue;
+        }
+        heap_free(heap, ptrs[i]);
+    }
+}
+
+size_t mmal_malloc_batch(size_t size, size_t n, void** ptrs){
+    heap_lock(&default_heap);
+    size_t count = heap_malloc_batch(&default_heap, size, n, ptrs);
+    heap_unlock(&default_heap);
+    return count;
+}
+
+void mmal_free_batch(void** ptrs, size_t n){
+    heap_lock(&default_heap);
+    heap_free_batch(&default_heap, ptrs, n);
+    heap_unlock(&default_heap);
+}
+
+/**
+ * Current time in ms for the maintenance pass.
+ */
+static
+uint64_t clock_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000u + (uint64_t)ts.tv_nsec/1000000u;
+}
+
+/**
+ * Return the handle of an allocated block, NULL if the block was not
+ * allocated by mmal_halloc(). The first word of the block must point to
+ * a slot of the table that points back to the block.
+ */
+static
+Handle* hdr_handle(Header* hdr){
+    if( handle_table == NULL || hdr_asize(hdr) == 0 || hdr_asize(hdr) == ASIZE_QUICK
+        || hdr->size < HANDLE_PREFIX)
+        return NULL;
+
+    uintptr_t handle = *(uintptr_t*)(&hdr[1]);
+    uintptr_t table = (uintptr_t)handle_table;
+    if( handle < table || handle >= (uintptr_t)(&handle_table[MMAL_HANDLE_MAX])
+        || (handle - table) % sizeof(Handle) != 0)
+        return NULL;
+    return ((Handle*)handle)->block == &hdr[1] ? (Handle*)handle : NULL;
+}
+
+/**
+ * Lowest free block of at least 'size' bytes below 'limit'.
+ * @return the block or NULL if there is none.
+ */
+static
+Header* lowest_fit(mmal_heap_t* heap, size_t size, Header* limit){
+    if(heap->free_list && heap->free_ordered){
+        for(Header* hdr = heap->free_head;
+            hdr != NULL && (uintptr_t)hdr < (uintptr_t)limit;
+            hdr = FREE_LINK(hdr)->next)
+            if(hdr->size >= size) return hdr;
+        return NULL;
+    }
+    if(heap->free_list){
+        /// Out of address order, the whole list is looked at
+        Header* lowest = NULL;
+        for(Header* hdr = heap->free_head; hdr != NULL; hdr = FREE_LINK(hdr)->next)
+            if( hdr->size >= size && (uintptr_t)hdr < (uintptr_t)limit
+                && (lowest == NULL || (uintptr_t)hdr < (uintptr_t)lowest))
+                lowest = hdr;
+        return lowest;
+    }
+
+    /// The ring is in address order from the first block
+    Header* start = (Header*)(&(*heap->first_arena)[1]);
+    Header* hdr = start;
+    do{
+        if((uintptr_t)hdr >= (uintptr_t)limit) break;
+        if(hdr_asize(hdr) == 0 && hdr->size >= size) return hdr;
+        hdr = hdr->next;
+    } while(hdr != start);
+    return NULL;
+}
+
+/**
+ * Slide an allocated block into the free block in front of it, so that
+ * the free space moves behind the block and can merge with what follows.
+ * @param heap      heap owning the blocks
+ * @param left      free block
+ * @param hdr       allocated block right after 'left'
+ * @return the new header of the block, 'left'.
+ */
+/**
+ *   +------+------+------+--------+       +------+--------+------+------+
+ *   |Header|.free.|Header|DD data |  ==>  |Header|DD data |Header|.free.|
+ *   +------+------+------+--------+       +------+--------+------+------+
+ *   ^ left        ^ hdr                   ^ left          ^ rest
+ */
+static
+Header* heap_slide(mmal_heap_t* heap, Header* left, Header* hdr){
+    Header* prev = heap->free_list ? FREE_LINK(left)->prev : NULL;
+    Header* next = hdr->next;
+    size_t free_size = left->size;
+    size_t size = hdr->size;
+    size_t asize = hdr_asize(hdr);
+    if(heap->rover == hdr) heap->rover = left;
+
+    /// Move the data, then lay out both headers again
+    free_unlink(heap, left);
+    memmove(&left[1], &hdr[1], asize);
+    left->size  = size;
+    Header* rest = (Header*)((char*)(&left[1]) + size);
+    rest->size  = free_size;
+    rest->asize = 0;
+    rest->next  = next;
+    left->next  = rest;
+    hdr_set_asize(left, asize);
+    hdr_mark_next(rest);
+
+    /// The free space takes the place of 'left' in the free list
+    free_insert(heap, prev, rest);
+    if(hdr_can_merge(rest, rest->next)){
+        free_unlink(heap, rest->next);
+        heap_merge(heap, rest, rest->next);
+        free_foot(heap, rest);
+    }
+    free_info_reset(rest);
+    return left;
+}
+
+/**
+ * Move an allocated block into a free block lower in the heap and free
+ * its old place.
+ * @param heap      heap owning the blocks
+ * @param to        free block of at least hdr->size bytes
+ * @param hdr       allocated block
+ * @return the new header of the block, 'to'.
+ */
+static
+Header* heap_move(mmal_heap_t* heap, Header* to, Header* hdr){
+    if(hdr_should_split(to, hdr->size, heap->min_split))
+        free_replace(heap, to, hdr_split(to, hdr->size));
+    else
+        free_unlink(heap, to);
+    hdr_set_asize(to, hdr_asize(hdr));
+    block_copy(heap, &to[1], &hdr[1], hdr_asize(hdr));
+    heap_release(heap, hdr);
+    return to;
+}
+
+/**
+ * Incremental compaction. Walks the header ring from where the last call
+ * stopped and moves every unlocked handle block to the lowest free block
+ * below it that fits, or slides it into a free block right in front of
+ * it. Free space gathers at the end of the arenas and arenas whose blocks
+ * all moved away are unmapped.
+ * @param heap      heap to compact
+ * @param budget    bytes to move (and headers to visit) in this call
+ * @return true if the pass over the heap is not finished yet.
+ */
+static
+bool heap_compact(mmal_heap_t* heap, size_t budget){
+    size_t spent = 0;
+    while(spent < budget){
+        if(*heap->first_arena == NULL){
+            heap->compact = NULL;
+            return false;
+        }
+        Header* start = (Header*)(&(*heap->first_arena)[1]);
+        if(heap->compact == NULL) heap->compact = start;
+
+        /// Look at the block after the cursor, the pass ends at the start
+        Header* prev = heap->compact;
+        Header* hdr = prev->next;
+        if(hdr == start){
+            heap->compact = NULL;
+            return false;
+        }
+        spent += sizeof(Header);
+
+        Handle* handle = hdr_handle(hdr);
+        if(handle == NULL || handle->locks != 0){
+            heap->compact = hdr;
+            continue;
+        }
+
+        /// Move the block down. The cursor stays, the block after it is
+        /// looked at again.
+        Header* to = lowest_fit(heap, hdr->size, hdr);
+        if(to != NULL){
+            spent += hdr_asize(hdr);
+            handle->block = &heap_move(heap, to, hdr)[1];
+            heap_release_empty(heap, hdr);
+        }
+        else if(hdr_asize(prev) == 0 && (char*)(&prev[1]) + prev->size == (char*)hdr){
+            spent += hdr_asize(hdr);
+            handle->block = &heap_slide(heap, prev, hdr)[1];
+        }
+        else{
+            heap->compact = hdr;
+        }
+    }
+    return true;
+}
+
+/**
+ * One maintenance pass over a heap, run by the maintenance thread or by
+ * mmal_heap_maintain():
+ *   - free blocks are stamped the first time the pass sees them; blocks
+ *     free for longer than decay_ms get their pages purged (MADV_DONTNEED),
+ *     in whole huge pages for MMAL_OPT_HUGEPAGE heaps
+ *   - arenas free as a whole for longer than retain_ms are unmapped, as
+ *     long as spare_bytes of free space stays mapped
+ *   - an arena is mapped in advance when less than spare_bytes is free
+ *   - above soft_limit, free arenas are unmapped and free pages purged
+ *     right away
+ *   - with compact_bytes, a compaction step moves handle blocks down
+ * @param heap      heap to maintain, locked by the caller if needed
+ * @param now       current time in ms
+ */
+static
+void heap_maintain(mmal_heap_t* heap, uint64_t now){
+    size_t granule = heap->hugepage ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t free_bytes = 0;
+
+    /// Above the soft limit nothing waits for the timers
+    if(heap_over_limit(heap, 0, heap->soft_limit)) heap_relieve(heap);
+
+    /// Periodic consolidation of deferred frees and a compaction step
+    heap_flush_quick(heap);
+    if(heap->compact_bytes != 0) heap_compact(heap, heap->compact_bytes);
+
+    /// Stamp and purge free blocks
+    Arena* first = *heap->first_arena;
+    if(first != NULL){
+        Header* start = (Header*)(&first[1]);
+        Header* hdr = start;
+        do{
+            if(hdr_asize(hdr) == 0 && hdr->size >= FREE_INFO_MIN){
+                free_bytes += hdr->size;
+                FreeInfo* info = FREE_INFO(hdr);
+                if(info->tag != FREE_INFO_TAG(hdr)){
+                    info->tag    = FREE_INFO_TAG(hdr);
+                    info->since  = now;
+                    info->purged = false;
+                }
+                else if(!info->purged && now - info->since >= heap->decay_ms){
+                    hdr_purge(hdr, granule);
+                    info->purged = true;
+                }
+            }
+            hdr = hdr->next;
+        } while(hdr != start);
     }
-    else{ // 'size' is bigger than is allocated
-        /// Check if current header has enough space
-        if(used_hdr->size >= size){
-            used_hdr->asize = size;
-            return ptr;
+
+    /// The arena of a file-backed heap is its file, it stays as it is
+    if(heap->map != NULL) return;
+
+    /// Unmap arenas that stayed free long enough
+    Arena* prev = NULL;
+    Arena* arena = first;
+    while(arena != NULL){
+        Arena* next = arena->next;
+        Header* hdr = (Header*)(&arena[1]);
+        FreeInfo* info = FREE_INFO(hdr);
+        if( hdr_asize(hdr) == 0
+            && hdr->size == arena->size-sizeof(Arena)-sizeof(Header)
+            && info->tag == FREE_INFO_TAG(hdr)
+            && now - info->since >= heap->retain_ms
+            && free_bytes - hdr->size >= heap->spare_bytes){
+            free_bytes -= hdr->size;
+            arena_release(heap, prev, arena);
+        }
+        else{
+            prev = arena;
         }
+        arena = next;
+    }
 
-        /// Check if next header is free and has enough space
-        size_t hdr_asize = used_hdr->asize;
-        used_hdr->asize = 0;
-        if( used_hdr->next->asize == 0
-            && used_hdr->next->size+sizeof(Header) >= size-used_hdr->size
-            && hdr_can_merge(used_hdr, used_hdr->next)){
-            /// True: Merge headers
-            hdr_merge(used_hdr, used_hdr->next);
+    /// Keep a spare arena ready, so that allocations do not have to map,
+    /// unless it would cross the soft limit
+    if( free_bytes < heap->spare_bytes
+        && !heap_over_limit(heap, heap->spare_bytes - free_bytes, heap->soft_limit))
+        heap_grow(heap, heap->spare_bytes - free_bytes);
+}
 
-            /// Split unused space
-            if(hdr_should_split(used_hdr, size))
-                hdr_split(used_hdr, size);
+/**
+ * Body of the maintenance thread: one pass every 'maint_interval_ms' until
+ * mmal_heap_maintenance_stop(). The heap is locked except while waiting.
+ */
+static
+void* maint_main(void* arg){
+    mmal_heap_t* heap = arg;
+    pthread_mutex_lock(&heap->lock);
+    while(!heap->maint_stop){
+        heap_maintain(heap, clock_ms());
 
-            /// Set new 'asize'
-            used_hdr->asize = size;
-            return ptr;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += heap->maint_interval_ms / 1000;
+        deadline.tv_nsec += (long)(heap->maint_interval_ms % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L){
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
         }
-        else{
-            /// False: Find or allocate new space
-            Header* new_hdr = &((Header*)mmalloc(size))[-1];
+        while(!heap->maint_stop
+              && pthread_cond_timedwait(&heap->maint_wake, &heap->lock, &deadline) == 0);
+    }
+    pthread_mutex_unlock(&heap->lock);
+    return NULL;
+}
 
-            /// Copy old data into new space
-            memcpy(&new_hdr[1], &used_hdr[1], hdr_asize);
+bool mmal_heap_maintenance_start(mmal_heap_t* heap, unsigned interval_ms){
+    heap = heap_of(heap);
+    if(heap->maint_running || heap->shared || interval_ms == 0) return false;
 
-            /// Free old space
-            mfree(&used_hdr[1]);
-            return &new_hdr[1];
+    /// From now on every call on the heap takes the lock
+    heap->maint_interval_ms = interval_ms;
+    heap->maint_stop = false;
+    heap->maint_running = true;
+    if(pthread_create(&heap->maint_thread, NULL, maint_main, heap) != 0){
+        heap->maint_running = false;
+        return false;
+    }
+    return true;
+}
+
+void mmal_heap_maintenance_stop(mmal_heap_t* heap){
+    heap = heap_of(heap);
+    if(!heap->maint_running) return;
+
+    pthread_mutex_lock(&heap->lock);
+    heap->maint_stop = true;
+    pthread_cond_signal(&heap->maint_wake);
+    pthread_mutex_unlock(&heap->lock);
+    pthread_join(heap->maint_thread, NULL);
+    heap->maint_running = false;
+}
+
+void mmal_heap_maintain(mmal_heap_t* heap){
+    heap = heap_of(heap);
+    heap_lock(heap);
+    heap_maintain(heap, clock_ms());
+    heap_unlock(heap);
+}
+
+mmal_handle_t mmal_halloc(size_t size){
+    return mmal_heap_halloc(&default_heap, size);
+}
+
+/**
+ * Allocate a movable block. The handle slot is taken first, the block
+ * holds a pointer back to it in front of the program data.
+ * @param heap      heap to allocate from, NULL for the default heap
+ * @param size      requested size for program
+ * @return the handle or NULL if error, size = 0 or the heap is shared or
+ * file-backed.
+ */
+mmal_handle_t mmal_heap_halloc(mmal_heap_t* heap, size_t size){
+    /// Check function arguments
+    heap = heap_of(heap);
+    if(size == 0 || size > SIZE_MAX - HANDLE_PREFIX || heap->map != NULL) return NULL;
+
+    Handle* handle = handle_alloc();
+    if(handle == NULL) return NULL;
+
+    heap_lock(heap);
+    void* block = heap_malloc(heap, size + HANDLE_PREFIX);
+    if(block != NULL){
+        *(Handle**)block = handle;
+        handle->block = block;
+        handle->heap  = heap;
+        handle->locks = 0;
+    }
+    heap_unlock(heap);
+
+    if(block == NULL){
+        handle_free(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+void* mmal_hlock(mmal_handle_t handle){
+    if(handle == NULL) return NULL;
+    heap_lock(handle->heap);
+    handle->locks++;
+    void* ptr = (char*)handle->block + HANDLE_PREFIX;
+    heap_unlock(handle->heap);
+    return ptr;
+}
+
+void mmal_hunlock(mmal_handle_t handle){
+    if(handle == NULL) return;
+    heap_lock(handle->heap);
+    if(handle->locks > 0) handle->locks--;
+    heap_unlock(handle->heap);
+}
+
+void mmal_hfree(mmal_handle_t handle){
+    if(handle == NULL) return;
+    mmal_heap_t* heap = handle->heap;
+    heap_lock(heap);
+    void* block = handle->block;
+    handle->block = NULL;
+    heap_free(heap, block);
+    heap_unlock(heap);
+    handle_free(handle);
+}
+
+bool mmal_compact(size_t budget){
+    return mmal_heap_compact(&default_heap, budget);
+}
+
+bool mmal_heap_compact(mmal_heap_t* heap, size_t budget){
+    heap = heap_of(heap);
+    heap_lock(heap);
+    bool more = heap_compact(heap, budget);
+    heap_unlock(heap);
+    return more;
+}
+
+/**
+ * Fault in every page of an arena now instead of on first touch.
+ * MADV_POPULATE_WRITE does it in one call where the kernel supports it,
+ * otherwise every page is touched; the contents are preserved.
+ */
+static
+void arena_prefault(Arena* arena){
+#ifdef MADV_POPULATE_WRITE
+    if(madvise(arena, arena->size, MADV_POPULATE_WRITE) == 0) return;
+#endif
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    for(size_t off = 0; off < arena->size; off += page){
+        volatile char* byte = (char*)arena + off;
+        *byte = *byte;
+    }
+}
+
+/**
+ * Map an arena with 'bytes' of free space ahead of time.
+ * @param heap      heap to reserve for
+ * @param bytes     free space to add
+ * @param flags     MMAL_RESERVE_* flags
+ * @return false if error or bytes = 0.
+ */
+static
+bool heap_reserve(mmal_heap_t* heap, size_t bytes, unsigned flags){
+    /// Check function arguments
+    if(bytes == 0) return false;
+
+    Header* hdr = heap_grow(heap, bytes);
+    if(hdr == NULL) return false;
+
+    if(flags & MMAL_RESERVE_POPULATE) arena_prefault(&((Arena*)hdr)[-1]);
+    return true;
+}
+
+bool mmal_reserve(size_t bytes, unsigned flags){
+    return mmal_heap_reserve(&default_heap, bytes, flags);
+}
+
+bool mmal_heap_reserve(mmal_heap_t* heap, size_t bytes, unsigned flags){
+    heap = heap_of(heap);
+    heap_lock(heap);
+    bool reserved = heap_reserve(heap, bytes, flags);
+    heap_unlock(heap);
+    return reserved;
+}
+
+/**
+ * Start of the file of a file-backed heap. The only arena of the heap
+ * follows it and spans the rest of the file.
+ *   +---------+-----+------+----------------------------+
+ *   |FileSuper|Arena|Header|............................|
+ *   +---------+-----+------+----------------------------+
+ *
+ *   |------------------- FileSuper.size ----------------|
+ */
+typedef struct file_super FileSuper;
+struct file_super {
+    /// FILE_MAGIC, FILE_VERSION and sizeof(Header), checked on open.
+    uint64_t magic;
+    uint32_t version;
+    uint32_t hdr_size;
+
+    /**
+     * Address the file is mapped at. The headers and the arena list in the
+     * file hold pointers valid for this address.
+     */
+    uintptr_t base;
+
+    /// Size of the file.
+    uint64_t size;
+
+    /// Offset of the root block (mmal_heap_set_root()), 0 if none.
+    uint64_t root;
+
+    /// Head of the arena list, see mmal_heap.first_arena.
+    Arena *arenas;
+
+    /// sizeof(mmal_heap_t) of a shared heap, 0 for a file.
+    uint64_t heap_size;
+};
+
+#define FILE_MAGIC      0x6d6d616c66696c65ull   // "mmalfile"
+#define SHARED_MAGIC    0x6d6d616c7368726dull   // "mmalshrm"
+#define FILE_VERSION    1
+/// Space of the super block, keeps what follows MMAL_MIN_ALIGN aligned.
+#define FILE_SUPER_SIZE ((sizeof(FileSuper) + 63) & ~(size_t)63)
+/// Space of the heap structure following the super block of a shared heap.
+#define SHARED_HEAP_SIZE ((sizeof(mmal_heap_t) + 63) & ~(size_t)63)
+
+/**
+ * Map a heap file, at 'hint' if that address is free.
+ * @return the mapping or NULL if error.
+ */
+static
+void* file_map(int fd, size_t size, uintptr_t hint){
+    void* map = MAP_FAILED;
+#ifdef MAP_FIXED_NOREPLACE
+    if(hint != 0)
+        map = mmap( (void*)hint, size, PROT_WRITE|PROT_READ,
+                    MAP_SHARED|MAP_FIXED_NOREPLACE, fd, 0);
+#endif
+    if(map == MAP_FAILED)
+        map = mmap( (void*)hint, size, PROT_WRITE|PROT_READ,
+                    MAP_SHARED, fd, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+/**
+ * Size a new heap file.
+ * @param fd        the empty file
+ * @param size      requested size, rounded up to the system page
+ * @param arena_off offset of the arena in the file
+ * @return false if error or the size is too small for a block.
+ */
+static
+bool file_resize(int fd, size_t* size, size_t arena_off){
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if(*size > SIZE_MAX - page) return false;
+    *size = (*size + page-1) & ~(page-1);
+    if(*size < arena_off + sizeof(Arena) + sizeof(Header) + DEFAULT_MIN_SPLIT)
+        return false;
+    return ftruncate(fd, (off_t)*size) == 0;
+}
+
+/**
+ * Read the super block of an existing heap file and check that this build
+ * can use it.
+ * @param fd        the file
+ * @param super     stores the super block
+ * @param magic     FILE_MAGIC or SHARED_MAGIC
+ * @return false if error or the file is not a heap of the kind.
+ */
+static
+bool file_check(int fd, FileSuper* super, uint64_t magic){
+    struct stat st;
+    return  fstat(fd, &st) == 0
+            && pread(fd, super, sizeof(*super), 0) == (ssize_t)sizeof(*super)
+            && super->magic == magic && super->version == FILE_VERSION
+            && super->hdr_size == sizeof(Header)
+            && super->heap_size == (magic == SHARED_MAGIC ? sizeof(mmal_heap_t) : 0)
+            && super->size == (uint64_t)st.st_size;
+}
+
+/**
+ * Make a heap file valid for the address it is mapped at now. When the
+ * file could not be mapped where it was last time, every pointer in the
+ * arena list and in the headers is moved by the difference. Blocks left
+ * on a quick list by a process that did not close the heap become free.
+ * @param super     start of the mapping
+ */
+/**
+ *   old base                           new base
+ *   v                                  v
+ *   +-----+------+---+------+---       +-----+------+---+------+---
+ *   |Super|Arena |Hdr| ...  |Hdr  ==>   |Super|Arena |Hdr| ...  |Hdr
+ *   +-----+------+---+------+---       +-----+------+---+------+---
+ *                  next ----^                         next ----^
+ *                                                     + delta
+ */
+static
+void file_rebase(FileSuper* super){
+    uintptr_t delta = (uintptr_t)super - super->base;
+    #define REBASE(ptr) ((ptr) = (void*)((uintptr_t)(ptr) + delta))
+
+    if(delta != 0) REBASE(super->arenas);
+    for(Arena* arena = super->arenas; arena != NULL; arena = arena->next){
+        if(delta != 0 && arena->next != NULL) REBASE(arena->next);
+
+        /// Visit the blocks in address order, the ring may still be stale
+        char* end = (char*)arena + arena->size;
+        Header* hdr = (Header*)(&arena[1]);
+        while((char*)hdr < end){
+            if(delta != 0) REBASE(hdr->next);
+            if(hdr_asize(hdr) == ASIZE_QUICK) hdr_set_asize(hdr, 0);
+            hdr = (Header*)((char*)(&hdr[1]) + hdr->size);
         }
     }
+    #undef REBASE
+    super->base = (uintptr_t)super;
+}
+
+/**
+ * Lay out a new heap file: the super block and one arena with a single
+ * free block.
+ * @param super     start of the mapping
+ * @param magic     FILE_MAGIC or SHARED_MAGIC
+ * @param arena_off offset of the arena
+ * @param size      size of the file
+ */
+static
+void file_format(FileSuper* super, uint64_t magic, size_t arena_off, size_t size){
+    Arena* arena = (Arena*)((char*)super + arena_off);
+    arena->next = NULL;
+    arena->size = size - arena_off;
+
+    Header* hdr = (Header*)(&arena[1]);
+    hdr_ctor(hdr, arena->size-sizeof(Arena)-sizeof(Header));
+    hdr->next = hdr;
+
+    super->hdr_size = sizeof(Header);
+    super->base     = (uintptr_t)super;
+    super->size     = size;
+    super->root     = 0;
+    super->arenas   = arena;
+    super->heap_size = magic == SHARED_MAGIC ? sizeof(mmal_heap_t) : 0;
+    super->version  = FILE_VERSION;
+    super->magic    = magic;
+}
+
+/**
+ * Open a heap kept in a file. The file is mapped shared, so blocks written
+ * by the program end up in the file and are there when the heap is opened
+ * again, e.g. after a restart.
+ * @param path      file to open, created if it does not exist
+ * @param size      size of a new file, unused for an existing one
+ * @return the heap or NULL if error.
+ */
+mmal_heap_t* mmal_heap_open_file(const char* path, size_t size){
+    /// Check function arguments
+    if(path == NULL) return NULL;
+
+    /// Open the file, one heap per file
+    int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0600);
+    if(fd < 0) return NULL;
+    if(flock(fd, LOCK_EX|LOCK_NB) != 0){
+        close(fd);
+        return NULL;
+    }
+
+    /// Size a new file, check an existing one
+    struct stat st;
+    FileSuper old;
+    if(fstat(fd, &st) != 0) goto fail_fd;
+    bool fresh = st.st_size == 0;
+    if(fresh){
+        if(!file_resize(fd, &size, FILE_SUPER_SIZE)) goto fail_fd;
+    }
+    else{
+        if(!file_check(fd, &old, FILE_MAGIC)) goto fail_fd;
+        size = (size_t)old.size;
+    }
+
+    /// Map it where it was mapped last time if possible
+    FileSuper* super = file_map(fd, size, fresh ? 0 : old.base);
+    if(super == NULL) goto fail_fd;
+    if(fresh) file_format(super, FILE_MAGIC, FILE_SUPER_SIZE, size);
+    else file_rebase(super);
+
+    /// The heap structure lives in the default heap like any other
+    mmal_heap_t* heap = mmalloc(sizeof(mmal_heap_t));
+    if(heap == NULL){
+        munmap(super, size);
+        goto fail_fd;
+    }
+    *heap = (mmal_heap_t)HEAP_INIT(&super->arenas);
+    heap->map = super;
+    heap->map_size = size;
+    heap->mapped_bytes = size;
+    heap->fd = fd;
+    pthread_mutex_init(&heap->lock, NULL);
+    pthread_cond_init(&heap->maint_wake, NULL);
+
+    /// Merge what the last process left unmerged and build the free list
+    heap_coalesce(heap);
+    return heap;
+
+fail_fd:
+    close(fd);
+    return NULL;
+}
+
+bool mmal_heap_sync(mmal_heap_t* heap){
+    if(heap == NULL || heap->map == NULL) return false;
+    heap_lock(heap);
+    bool synced = msync(heap->map, heap->map_size, MS_SYNC) == 0;
+    heap_unlock(heap);
+    return synced;
+}
+
+size_t mmal_heap_offset(mmal_heap_t* heap, const void* ptr){
+    if(heap == NULL || heap->map == NULL || ptr == NULL) return 0;
+    return (size_t)((const char*)ptr - (const char*)heap->map);
+}
+
+void* mmal_heap_at(mmal_heap_t* heap, size_t offset){
+    if(heap == NULL || heap->map == NULL || offset == 0 || offset >= heap->map_size)
+        return NULL;
+    return (char*)heap->map + offset;
+}
+
+void* mmal_heap_root(mmal_heap_t* heap){
+    if(heap == NULL || heap->map == NULL) return NULL;
+    return mmal_heap_at(heap, ((FileSuper*)heap->map)->root);
+}
+
+bool mmal_heap_set_root(mmal_heap_t* heap, void* ptr){
+    if(heap == NULL || heap->map == NULL) return false;
+    ((FileSuper*)heap->map)->root = mmal_heap_offset(heap, ptr);
+    return true;
+}
+
+/**
+ * Create a heap in a shared memory segment (memfd). The heap structure is
+ * part of the segment, right after the super block, so every process
+ * mapping the segment works on the same heap:
+ *   +---------+----------+-----+------+------------------+
+ *   |FileSuper|mmal_heap |Arena|Header|..................|
+ *   +---------+----------+-----+------+------------------+
+ * Every process maps the segment at the same address, so the pointers in
+ * the heap are valid everywhere.
+ * @param size      size of the segment
+ * @param fd        stores the segment to pass to other processes
+ * @return the heap or NULL if error.
+ */
+mmal_heap_t* mmal_heap_create_shared(size_t size, int* fd){
+    /// Check function arguments
+    if(fd == NULL) return NULL;
+
+    /// Create and map the segment
+    int seg = memfd_create("mmal", MFD_CLOEXEC);
+    if(seg < 0) return NULL;
+    size_t arena_off = FILE_SUPER_SIZE + SHARED_HEAP_SIZE;
+    if(!file_resize(seg, &size, arena_off)) goto fail_fd;
+    FileSuper* super = file_map(seg, size, 0);
+    if(super == NULL) goto fail_fd;
+
+    /// Set up the heap structure inside it, with a process-shared lock
+    mmal_heap_t* heap = (mmal_heap_t*)((char*)super + FILE_SUPER_SIZE);
+    *heap = (mmal_heap_t)HEAP_INIT(&super->arenas);
+    heap->map = super;
+    heap->map_size = size;
+    heap->mapped_bytes = size;
+    heap->shared = true;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&heap->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    file_format(super, SHARED_MAGIC, arena_off, size);
+    free_rebuild(heap);
+    *fd = seg;
+    return heap;
+
+fail_fd:
+    close(seg);
+    return NULL;
+}
+
+/**
+ * Map a shared heap created by another process.
+ * @param fd        segment from mmal_heap_create_shared()
+ * @return the heap or NULL if error or the address of the heap is taken.
+ */
+mmal_heap_t* mmal_heap_attach_shared(int fd){
+    FileSuper old;
+    if(!file_check(fd, &old, SHARED_MAGIC)) return NULL;
+
+    /// Pointers in the heap are only valid at the creator's address
+    FileSuper* super = file_map(fd, (size_t)old.size, old.base);
+    if(super == NULL) return NULL;
+    if((uintptr_t)super != old.base){
+        munmap(super, (size_t)old.size);
+        return NULL;
+    }
+    return (mmal_heap_t*)((char*)super + FILE_SUPER_SIZE);
+}
+
+/**
+ * The region structure. Blocks are carved from the arena list by bumping
+ * a pointer, there are no headers.
+ *   +-----+-------------------+--------------------+
+ *   |Arena|DDDD used DDDDDDDDD|....................|
+ *   +-----+-------------------+--------------------+
+ *                             ^                    ^
+ *                             bump                 end
+ */
+struct mmal_region {
+    /// Arena list of the region, in the order the arenas were mapped.
+    Arena *first;
+
+    /// Arena the blocks are currently taken from.
+    Arena *cur;
+
+    /// First free byte and the end of 'cur'.
+    char *bump;
+    char *end;
+
+    /// MMAL_REGION_* flags.
+    unsigned flags;
+};
+
+/// Largest arena a region maps when it grows geometrically.
+#define REGION_MAX_GROW (64*PAGE_SIZE)
+
+/**
+ * Make 'arena' the current arena of the region.
+ */
+static
+void region_use(mmal_region_t* region, Arena* arena){
+    region->cur  = arena;
+    region->bump = (char*)(&arena[1]);
+    region->end  = (char*)arena + arena->size;
+}
+
+/**
+ * Move the region to an arena with at least 'size' free bytes. Arenas
+ * kept by MMAL_REGION_KEEP are reused first, then a new one is mapped,
+ * twice as big as the last one (up to REGION_MAX_GROW).
+ * @return false if no memory is available.
+ */
+static
+bool region_grow(mmal_region_t* region, size_t size){
+    /// Reuse an already mapped arena after 'cur'
+    Arena* last = region->cur;
+    if(last != NULL){
+        for(Arena* a = last->next; a != NULL; a = a->next){
+            if(a->size - sizeof(Arena) >= size){
+                region_use(region, a);
+                return true;
+            }
+            last = a;
+        }
+    }
+
+    /// Map a new arena
+    size_t grow = last != NULL ? last->size*2 : PAGE_SIZE;
+    if(grow > REGION_MAX_GROW) grow = REGION_MAX_GROW;
+    if(grow < size+sizeof(Arena)+sizeof(Header)) grow = size+sizeof(Arena)+sizeof(Header);
+    Arena* arena = arena_alloc(grow, false);
+    if(arena == NULL) return false;
+
+    if(last == NULL) region->first = arena;
+    else last->next = arena;
+    region_use(region, arena);
+    return true;
+}
+
+mmal_region_t* mmal_region_create(unsigned flags){
+    mmal_region_t* region = mmalloc(sizeof(mmal_region_t));
+    if(region == NULL) return NULL;
+
+    region->first = NULL;
+    region->cur   = NULL;
+    region->bump  = NULL;
+    region->end   = NULL;
+    region->flags = flags;
+    return region;
+}
+
+void* mmal_region_alloc(mmal_region_t* region, size_t size){
+    /// Check function arguments
+    if(region == NULL || size == 0) return NULL;
+    if(size > SIZE_MAX - MMAL_REGION_ALIGN - sizeof(Arena) - sizeof(Header)) return NULL;
+
+    /// Bump the pointer
+    size = (size + MMAL_REGION_ALIGN-1) & ~(size_t)(MMAL_REGION_ALIGN-1);
+    if((size_t)(region->end - region->bump) < size){
+        if(!region_grow(region, size)) return NULL;
+    }
+    void* ptr = region->bump;
+    region->bump += size;
+    return ptr;
+}
+
+void mmal_region_reset(mmal_region_t* region){
+    /// Check function argument
+    if(region == NULL || region->first == NULL) return;
+
+    /// Unmap all but the first arena, unless asked to keep them warm
+    if(!(region->flags & MMAL_REGION_KEEP)){
+        arena_unmap_list(region->first->next);
+        region->first->next = NULL;
+    }
+    region_use(region, region->first);
+}
+
+void mmal_region_release(mmal_region_t* region){
+    /// Check function argument
+    if(region == NULL) return;
+
+    arena_unmap_list(region->first);
+    mfree(region);
+}
+
+/**
+ * Module of an allocation site for the profile file: the base name of the
+ * shared object or program and its load address, which vary from run to
+ * run, so sites are stored as offsets into their module.
+ */
+typedef struct site_module SiteModule;
+struct site_module {
+    uintptr_t pc;
+    const char* name;
+    uintptr_t base;
+};
+
+/**
+ * Base name of a module of dl_iterate_phdr(), the program has none.
+ */
+static
+const char* site_module_name(const char* path){
+    if(path == NULL || path[0] == '\0') return program_invocation_short_name;
+    const char* slash = strrchr(path, '/');
+    return slash != NULL ? slash+1 : path;
+}
+
+/**
+ * dl_iterate_phdr() callback: the module containing 'pc'.
+ */
+static
+int site_module_of(struct dl_phdr_info* info, size_t size, void* arg){
+    SiteModule* module = arg;
+    (void)size;
+    for(size_t i = 0; i < info->dlpi_phnum; i++){
+        const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+        if(phdr->p_type != PT_LOAD) continue;
+        if(module->pc - (info->dlpi_addr + phdr->p_vaddr) < phdr->p_memsz){
+            module->name = site_module_name(info->dlpi_name);
+            module->base = info->dlpi_addr;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * dl_iterate_phdr() callback: the module called 'name'.
+ */
+static
+int site_module_named(struct dl_phdr_info* info, size_t size, void* arg){
+    SiteModule* module = arg;
+    (void)size;
+    if(strcmp(site_module_name(info->dlpi_name), module->name) != 0) return 0;
+    module->base = info->dlpi_addr;
+    return 1;
+}
+
+void mmal_site_learn(unsigned rate){
+    heap_lock(&default_heap);
+
+    /// Count the long-lived samples and drop the others, their lifetime
+    /// cannot be measured without the clock
+    if(rate == 0 && site_rate != 0){
+        site_age();
+        memset(site_samples, 0, sizeof(site_samples));
+        site_live = 0;
+    }
+    if(rate != site_rate){
+        site_rate = rate;
+        site_countdown = rate;
+    }
+    heap_unlock(&default_heap);
+}
+
+void mmal_site_reset(void){
+    heap_lock(&default_heap);
+    memset(sites, 0, sizeof(sites));
+    memset(site_samples, 0, sizeof(site_samples));
+    site_count = 0;
+    site_live = 0;
+    site_placing = false;
+    heap_unlock(&default_heap);
+}
+
+bool mmal_site_save(const char* path){
+    FILE* file = fopen(path, "w");
+    if(file == NULL) return false;
+
+    /// Samples alive long enough count before the verdicts are written
+    heap_lock(&default_heap);
+    site_age();
+    fprintf(file, "# mmal sites: S|L offset module\n");
+    for(size_t i = 0; i < SITE_MAX; i++){
+        if(sites[i].pc == NULL || sites[i].hints == 0) continue;
+        SiteModule module = { .pc = (uintptr_t)sites[i].pc };
+        if(dl_iterate_phdr(site_module_of, &module) == 0) continue;
+        fprintf(file, "%c %" PRIxPTR " %s\n",
+                sites[i].hints == MMAL_SHORT_LIVED ? 'S' : 'L',
+                module.pc - module.base, module.name);
+    }
+    heap_unlock(&default_heap);
+    return fclose(file) == 0;
+}
+
+bool mmal_site_load(const char* path){
+    FILE* file = fopen(path, "r");
+    if(file == NULL) return false;
+
+    char line[512];
+    char name[256];
+    char kind;
+    uintptr_t offset;
+    heap_lock(&default_heap);
+    while(fgets(line, sizeof(line), file) != NULL){
+        if(sscanf(line, " %c %" SCNxPTR " %255s", &kind, &offset, name) != 3) continue;
+        if(kind != 'S' && kind != 'L') continue;
+
+        /// Sites of modules not loaded in this run are skipped
+        SiteModule module = { .name = name };
+        if(dl_iterate_phdr(site_module_named, &module) == 0) continue;
+        Site* site = site_find((const void*)(module.base + offset), true);
+        if(site == NULL) break;
+
+        /// A loaded verdict weighs like the fewest samples that make one,
+        /// so learning can still overturn it
+        site->short_count = kind == 'S' ? SITE_MIN_SAMPLES : 0;
+        site->long_count  = kind == 'L' ? SITE_MIN_SAMPLES : 0;
+        site_judge(site);
+    }
+    heap_unlock(&default_heap);
+    fclose(file);
+    return true;
 }
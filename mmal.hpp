@@ -0,0 +1,120 @@
+/**
+ * C++ interface of mmal.
+ *
+ * mmal::allocator<T> is an STL allocator on the default heap,
+ * mmal::heap_resource a std::pmr::memory_resource on an mmal heap.
+ * Replacement of the global operator new/delete lives in mmal_new.cpp,
+ * link it in to route every C++ allocation to mmal.
+ */
+#ifndef MMAL_HPP
+#define MMAL_HPP
+
+extern "C" {
+#include "mmal.h"
+}
+#include "mmal_ext.h"
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+
+namespace mmal {
+
+#if defined(__cpp_lib_allocate_at_least)
+template <class Pointer>
+using allocation_result = std::allocation_result<Pointer>;
+#else
+/// std::allocation_result of C++23, for allocate_at_least() before it.
+template <class Pointer>
+struct allocation_result {
+    Pointer ptr;
+    std::size_t count;
+};
+#endif
+
+/**
+ * STL-compatible allocator on the default heap. Deallocation goes through
+ * the sized mfree_sized() path.
+ */
+template <class T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+
+    template <class U>
+    allocator(const allocator<U>&) noexcept {}
+
+    T* allocate(std::size_t n){
+        if(n > static_cast<std::size_t>(-1) / sizeof(T))
+            throw std::bad_array_new_length();
+        void* ptr = mmal_aligned_alloc(alignof(T), n != 0 ? n*sizeof(T) : 1);
+        if(ptr == nullptr) throw std::bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+
+    /// Hand the slack of the block to the container as extra capacity.
+    /// C++23 containers call it themselves, older code may call it directly.
+    allocation_result<T*> allocate_at_least(std::size_t n){
+        T* ptr = allocate(n);
+        return { ptr, mmal_usable_size(ptr) / sizeof(T) };
+    }
+
+    void deallocate(T* ptr, std::size_t n) noexcept {
+        mfree_sized(ptr, n != 0 ? n*sizeof(T) : 1);
+    }
+
+    template <class U>
+    bool operator==(const allocator<U>&) const noexcept { return true; }
+
+    template <class U>
+    bool operator!=(const allocator<U>&) const noexcept { return false; }
+};
+
+/**
+ * Polymorphic memory resource backed by an mmal heap. By default the
+ * resource creates its own heap and destroys it together with every block
+ * still allocated from it.
+ */
+class heap_resource : public std::pmr::memory_resource {
+public:
+    heap_resource() : heap_(mmal_heap_create()), owned_(true) {
+        if(heap_ == nullptr) throw std::bad_alloc();
+    }
+
+    /// Use an existing heap (NULL for the default heap) without owning it.
+    explicit heap_resource(mmal_heap_t* heap) noexcept
+        : heap_(heap), owned_(false) {}
+
+    heap_resource(const heap_resource&) = delete;
+    heap_resource& operator=(const heap_resource&) = delete;
+
+    ~heap_resource() override {
+        if(owned_) mmal_heap_destroy(heap_);
+    }
+
+    mmal_heap_t* heap() const noexcept { return heap_; }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+        void* ptr = mmal_heap_aligned_alloc(heap_, alignment, bytes != 0 ? bytes : 1);
+        if(ptr == nullptr) throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void* ptr, std::size_t, std::size_t) override {
+        mmal_heap_free(heap_, ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+
+    mmal_heap_t* heap_;
+    bool owned_;
+};
+
+} // namespace mmal
+
+#endif // MMAL_HPP
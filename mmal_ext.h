@@ -0,0 +1,608 @@
+/**
+ * Extensions to the mmal.h interface.
+ *
+ * mmal.h declares the basic mmalloc/mfree/mrealloc trio working on the
+ * default heap. Everything declared here is optional on top of it.
+ */
+#ifndef MMAL_EXT_H
+#define MMAL_EXT_H
+
+#include <stdbool.h>    // bool
+#include <stddef.h>     // size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Resize a block of the default heap without ever moving it. Growing
+ * succeeds when the block already has the space or the block after it is
+ * free and big enough. On failure the block is left unchanged, so a
+ * container can fall back to allocating and copying on its own.
+ * @param ptr       pointer to previously allocated data
+ * @param size      a new requested size
+ * @return true if the block now holds 'size' bytes.
+ */
+bool mmal_try_expand(void* ptr, size_t size);
+
+/**
+ * Return the number of bytes the program may use in a block, which can be
+ * more than was requested. mrealloc() preserves all of them.
+ * @param ptr       pointer to previously allocated data
+ * @return usable size, 0 if ptr is NULL.
+ */
+size_t mmal_usable_size(void* ptr);
+
+/**
+ * mmalloc() that also reports the usable size of the returned block, so
+ * that a growing container can use the slack before calling mrealloc().
+ * @param size      requested size for program
+ * @param actual    stores the usable size (>= size) if not NULL
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+void* mmal_malloc_usable(size_t size, size_t* actual);
+
+/**
+ * Alignment of data returned by mmalloc(). Larger alignments need
+ * mmal_aligned_alloc().
+ */
+#define MMAL_MIN_ALIGN 8
+
+/**
+ * Allocate memory from the default heap with the data aligned to
+ * 'alignment'. Like mmalloc(), the call is a site for mmal_site_learn().
+ * The block is freed with mfree() as usual.
+ * @param alignment power of two
+ * @param size      requested size for program
+ * @return pointer to allocated data or NULL if error, size = 0 or
+ * alignment is not a power of two.
+ */
+void* mmal_aligned_alloc(size_t alignment, size_t size);
+
+/// Hints of mmal_malloc_hint(): the block is freed soon, e.g. per request.
+#define MMAL_SHORT_LIVED 0x1
+/// Hints of mmal_malloc_hint(): the block lives long, e.g. a cache entry.
+#define MMAL_LONG_LIVED  0x2
+
+/**
+ * Allocate memory with a lifetime hint. Short-lived and long-lived blocks
+ * come from separate arena pools, so a few survivors do not keep the
+ * arenas of short-lived blocks from emptying, and long-lived data stays
+ * dense. Arenas of short-lived blocks are unmapped when they empty out,
+ * except the last one. The block is freed or resized with mfree() and
+ * mrealloc() as usual.
+ * @param size      requested size for program
+ * @param hints     MMAL_SHORT_LIVED or MMAL_LONG_LIVED; no hint or both
+ *                  allocate like mmalloc()
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+void* mmal_malloc_hint(size_t size, unsigned hints);
+
+/**
+ * Learn lifetime hints per allocation site. A site is the return address
+ * of an mmalloc(), mmal_malloc_usable() or mmal_aligned_alloc() call.
+ * Wrappers around them show up as a single site: every operator new of
+ * mmal_new.cpp shares the few calls in that file. One call in 'rate' is sampled
+ * and the lifetime of its block measured in bytes allocated meanwhile.
+ * When most samples of a site are freed within 1 MiB, or live beyond
+ * 64 MiB, later calls from the site allocate as with MMAL_SHORT_LIVED or
+ * MMAL_LONG_LIVED. Placement goes on after learning stops. It pauses
+ * while the default heap has a memory limit, an OOM handler or a running
+ * maintenance thread, which the pools would bypass; other options of the
+ * default heap apply to the pools as well.
+ * @param rate      sample one call in 'rate', 0 stops sampling and keeps
+ *                  what was learned
+ */
+void mmal_site_learn(unsigned rate);
+
+/**
+ * Forget all learned and loaded sites; mmalloc() uses the default heap
+ * again.
+ */
+void mmal_site_reset(void);
+
+/**
+ * Write the hints of all decided sites to an offline profile. Sites are
+ * stored as module name and offset, so the profile stays valid across
+ * runs of the same binaries.
+ * @return false if the file cannot be written.
+ */
+bool mmal_site_save(const char* path);
+
+/**
+ * Load a profile of mmal_site_save() and place its sites right away.
+ * Sites of modules that are not loaded are skipped; when learning, new
+ * samples can still overturn a loaded hint.
+ * @return false if the file cannot be read.
+ */
+bool mmal_site_load(const char* path);
+
+/**
+ * Free a block of the default heap whose size the caller already knows,
+ * e.g. from C++ sized operator delete. Debug builds check 'size' against
+ * the block header, release builds ignore it and free like mfree().
+ * @param ptr       pointer to previously allocated data
+ * @param size      size passed to the allocation (or last reallocation),
+ *                  or anything up to the usable size of the block
+ */
+void mfree_sized(void* ptr, size_t size);
+
+/**
+ * Independent heap. Every heap owns its own arenas; blocks of one heap
+ * are never handed out by another one. The default heap used by
+ * mmalloc/mfree/mrealloc is addressed by passing NULL.
+ */
+typedef struct mmal_heap mmal_heap_t;
+
+/**
+ * Create a new empty heap. No arena is mapped until the first allocation.
+ * @return the new heap or NULL if error.
+ */
+mmal_heap_t* mmal_heap_create(void);
+
+/**
+ * Release a heap and every block allocated from it. All arenas owned by
+ * the heap are unmapped in one pass, there is no need to free the blocks
+ * one by one. Destroying the default heap (NULL) does nothing. A heap
+ * opened by mmal_heap_open_file() is closed, its blocks stay in the file.
+ * A shared heap is unmapped from the calling process only.
+ * @param heap      heap created by mmal_heap_create()
+ */
+void mmal_heap_destroy(mmal_heap_t* heap);
+
+/**
+ * mmalloc() working on the given heap.
+ * @param heap      heap to allocate from, NULL for the default heap
+ * @param size      requested size for program
+ */
+void* mmal_heap_malloc(mmal_heap_t* heap, size_t size);
+
+/**
+ * mfree() working on the given heap.
+ * @param heap      heap the block was allocated from, NULL for default heap
+ * @param ptr       pointer to previously allocated data
+ */
+void mmal_heap_free(mmal_heap_t* heap, void* ptr);
+
+/**
+ * mrealloc() working on the given heap.
+ * @param heap      heap the block was allocated from, NULL for default heap
+ * @param ptr       pointer to previously allocated data
+ * @param size      a new requested size
+ */
+void* mmal_heap_realloc(mmal_heap_t* heap, void* ptr, size_t size);
+
+/**
+ * Options of mmal_heap_setopt().
+ */
+enum mmal_opt {
+    /**
+     * Map arenas 2 MiB aligned in multiples of 2 MiB and advise transparent
+     * huge pages for them (MADV_HUGEPAGE). Cuts TLB misses of big heaps.
+     * Value 0 or 1, default 0.
+     */
+    MMAL_OPT_HUGEPAGE,
+
+    /**
+     * Smallest data size of the free remainder when a block is split. A
+     * block with less left over is handed out whole, so no slivers too
+     * small for any request end up in the header ring. Rounded up to
+     * MMAL_MIN_ALIGN, at least 16 (room for the free-list links).
+     * Default 16, the smallest size class.
+     */
+    MMAL_OPT_MIN_SPLIT,
+
+    /**
+     * Which part of a split free block mmalloc() hands out. 0 (default):
+     * the front, the remainder follows it. 1: the back, the remainder
+     * keeps its place in front, so a block carved again and again does
+     * not move behind the blocks taken from it. Value 0 or 1.
+     */
+    MMAL_OPT_SPLIT_BACK,
+
+    /**
+     * Search policy, one of MMAL_FIT_*. Default MMAL_FIT_FIRST.
+     */
+    MMAL_OPT_FIT,
+
+    /**
+     * Keep a doubly linked list of the free blocks. Its links live in the
+     * free blocks themselves, next to a boundary tag. Searches then visit
+     * free blocks only, instead of every block of the heap, and mfree()
+     * finds the free neighbours of a block without any search.
+     * 0: no list, the ring of all blocks is searched. 1 (default): a block
+     * with no free neighbour goes to the head of the list, so mfree() is
+     * O(1). 2: the list stays in address order; mfree() of such a block
+     * looks for its place among the free blocks below it.
+     */
+    MMAL_OPT_FREE_LIST,
+
+    /**
+     * Milliseconds a block stays free before the maintenance pass returns
+     * its pages to the system (MADV_DONTNEED). Default 10000.
+     */
+    MMAL_OPT_DECAY_MS,
+
+    /**
+     * Milliseconds an arena stays completely free before the maintenance
+     * pass unmaps it. Default 30000.
+     */
+    MMAL_OPT_RETAIN_MS,
+
+    /**
+     * Free bytes the maintenance pass keeps mapped. When less is free, an
+     * arena is mapped in advance; arenas are not unmapped below it.
+     * Default 0.
+     */
+    MMAL_OPT_SPARE_BYTES,
+
+    /**
+     * Deferred coalescing budget in bytes. Freed small blocks are kept
+     * unmerged on the quick-reuse list of the largest size class they
+     * hold and handed out again to the next request of that class, also
+     * to an aligned one when the block is aligned. The lists are
+     * consolidated in one pass when they hold more than this, when an
+     * allocation finds no free block and by the maintenance pass.
+     * 0 (default) merges every block when it is freed.
+     */
+    MMAL_OPT_DEFER_BYTES,
+
+    /**
+     * Bytes the maintenance pass lets the compactor move per pass, see
+     * mmal_heap_compact(). Default 0, no compaction.
+     */
+    MMAL_OPT_COMPACT_BYTES,
+
+    /**
+     * Soft limit on the bytes of all arenas of the heap. When an arena
+     * would cross it, or a maintenance pass finds the heap above it, free
+     * arenas are unmapped and free pages purged right away instead of
+     * after MMAL_OPT_RETAIN_MS and MMAL_OPT_DECAY_MS. The heap may still
+     * grow beyond it. Default 0, no limit.
+     */
+    MMAL_OPT_SOFT_LIMIT,
+
+    /**
+     * Hard limit on the bytes of all arenas of the heap. No arena is mapped
+     * beyond it; the OOM handler runs instead and the allocation fails if
+     * it cannot help. Default 0, no limit.
+     */
+    MMAL_OPT_HARD_LIMIT,
+
+    /**
+     * Blocks of at least this many bytes that mrealloc() or the compactor
+     * moves are copied with AVX2 or AVX-512 non-temporal stores, so that
+     * the copy does not evict the cache. Smaller blocks and CPUs without
+     * AVX2 use memcpy. Default 4 MiB, 0 always uses memcpy.
+     */
+    MMAL_OPT_STREAM_COPY,
+};
+
+/**
+ * Values of MMAL_OPT_FIT.
+ */
+enum mmal_fit {
+    /// Take the first block that fits, searching from the start of the heap.
+    MMAL_FIT_FIRST,
+
+    /**
+     * Take the first block that fits, searching from where the last
+     * search ended. Spreads allocations and skips the full front of the
+     * heap.
+     */
+    MMAL_FIT_NEXT,
+};
+
+/**
+ * Set an option of a heap. MMAL_OPT_HUGEPAGE applies to arenas mapped
+ * afterwards, so it is best set right after the heap is created. The
+ * maintenance options take effect with the next maintenance pass.
+ * @param heap      heap to configure, NULL for the default heap
+ * @param option    one of MMAL_OPT_*
+ * @param value     new value of the option
+ * @return false if the option or the value is invalid.
+ */
+bool mmal_heap_setopt(mmal_heap_t* heap, int option, size_t value);
+
+/**
+ * Handler called when a heap cannot grow, because of MMAL_OPT_HARD_LIMIT
+ * or because mmap failed. It runs without the heap lock and may free
+ * blocks of the heap, e.g. by evicting cache entries.
+ * @param heap      the heap, NULL for the default heap
+ * @param size      size of the block that does not fit
+ * @param arg       argument given to mmal_heap_set_oom_handler()
+ * @return true to retry the allocation, false to let it fail (NULL).
+ */
+typedef bool (*mmal_oom_handler_t)(mmal_heap_t* heap, size_t size, void* arg);
+
+/**
+ * Set the OOM handler of a heap. Shared heaps (mmal_heap_create_shared())
+ * take no handler: their heap structure lives in the shared segment, where
+ * the handler of one process would be called by the others.
+ * @param heap      heap to configure, NULL for the default heap
+ * @param handler   the handler, NULL for none
+ * @param arg       passed to the handler
+ * @return false for a shared heap.
+ */
+bool mmal_heap_set_oom_handler(mmal_heap_t* heap, mmal_oom_handler_t handler, void* arg);
+
+/**
+ * Bytes of all arenas a heap has mapped, the amount MMAL_OPT_SOFT_LIMIT
+ * and MMAL_OPT_HARD_LIMIT apply to.
+ * @param heap      heap to query, NULL for the default heap
+ */
+size_t mmal_heap_mapped_bytes(mmal_heap_t* heap);
+
+/**
+ * Start a background thread doing the maintenance pass of a heap every
+ * 'interval_ms': purging pages of blocks free for MMAL_OPT_DECAY_MS,
+ * unmapping arenas free for MMAL_OPT_RETAIN_MS and mapping a spare arena
+ * (MMAL_OPT_SPARE_BYTES). The syscalls move off the allocation path.
+ * While the thread runs, every call on the heap takes a per-heap lock.
+ * Starting and stopping must not race with other calls on the heap.
+ * @param heap      heap to maintain, NULL for the default heap
+ * @param interval_ms time between two passes, > 0
+ * @return false if the thread already runs or cannot be created.
+ */
+bool mmal_heap_maintenance_start(mmal_heap_t* heap, unsigned interval_ms);
+
+/**
+ * Stop the maintenance thread of a heap and wait for it. Nothing happens
+ * if no thread runs. mmal_heap_destroy() stops it as well.
+ * @param heap      heap to stop maintaining, NULL for the default heap
+ */
+void mmal_heap_maintenance_stop(mmal_heap_t* heap);
+
+/**
+ * Run one maintenance pass in the calling thread.
+ * @param heap      heap to maintain, NULL for the default heap
+ */
+void mmal_heap_maintain(mmal_heap_t* heap);
+
+/// Fault in the pages of reserved arenas right away.
+#define MMAL_RESERVE_POPULATE 0x1
+
+/**
+ * Map an arena with 'bytes' of free space ahead of time, e.g. to warm the
+ * allocator during startup. With MMAL_RESERVE_POPULATE its pages are also
+ * faulted in, so first touches do not fault later. A running maintenance
+ * thread purges and unmaps reserved space like any other free space;
+ * raise MMAL_OPT_SPARE_BYTES to keep it.
+ * @param bytes     free space to add
+ * @param flags     0 or MMAL_RESERVE_POPULATE
+ * @return false if error or bytes = 0.
+ */
+bool mmal_reserve(size_t bytes, unsigned flags);
+
+/**
+ * mmal_reserve() working on the given heap.
+ * @param heap      heap to reserve for, NULL for the default heap
+ */
+bool mmal_heap_reserve(mmal_heap_t* heap, size_t bytes, unsigned flags);
+
+/**
+ * Open a heap kept in a file, e.g. a large index that should survive a
+ * restart without being serialized. The file is mapped shared and holds
+ * the whole heap; blocks written by the program are in the file when it
+ * is opened again. The heap does not grow beyond the file: allocations
+ * fail when it is full. A file is used by one heap at a time.
+ *
+ * The file is mapped at the same address as last time when the address is
+ * free, so pointers stored in blocks stay valid. Otherwise the heap itself
+ * is relocated, but pointers in the program's data are not: programs that
+ * cannot rely on the address store offsets (mmal_heap_offset()) instead.
+ *
+ * mmal_heap_destroy() writes the file back and closes it.
+ * @param path      file to open, created if it does not exist
+ * @param size      size of a new file, rounded up to the system page;
+ *                  an existing file keeps its size
+ * @return the heap or NULL if error or the file is not a heap file.
+ */
+mmal_heap_t* mmal_heap_open_file(const char* path, size_t size);
+
+/**
+ * Write the blocks of a file-backed heap back to its file (msync).
+ * @param heap      heap opened by mmal_heap_open_file()
+ * @return false if error or the heap is not file-backed.
+ */
+bool mmal_heap_sync(mmal_heap_t* heap);
+
+/**
+ * Offset of a block of a file-backed or shared heap from its start.
+ * Unlike pointers, offsets stay valid wherever the heap is mapped.
+ * @param heap      heap opened by mmal_heap_open_file() or shared
+ * @param ptr       pointer into the heap
+ * @return the offset, 0 if ptr is NULL or the heap is not of that kind.
+ */
+size_t mmal_heap_offset(mmal_heap_t* heap, const void* ptr);
+
+/**
+ * Pointer to an offset returned by mmal_heap_offset().
+ * @param heap      heap opened by mmal_heap_open_file() or shared
+ * @param offset    offset into the heap
+ * @return the pointer, NULL if offset is 0 or outside the heap.
+ */
+void* mmal_heap_at(mmal_heap_t* heap, size_t offset);
+
+/**
+ * Root block of a file-backed or shared heap: the block a program finds
+ * its data from after opening or attaching the heap.
+ * @param heap      heap opened by mmal_heap_open_file() or shared
+ * @return the root block, NULL if none is set.
+ */
+void* mmal_heap_root(mmal_heap_t* heap);
+
+/**
+ * Set the root block of a file-backed or shared heap, stored as an offset
+ * in the heap.
+ * @param heap      heap opened by mmal_heap_open_file() or shared
+ * @param ptr       block of the heap or NULL
+ * @return false if the heap is not of that kind.
+ */
+bool mmal_heap_set_root(mmal_heap_t* heap, void* ptr);
+
+/**
+ * Create a heap in a shared memory segment, for processes that exchange
+ * buffers without copying. The whole heap, including its bookkeeping and
+ * a process-shared lock, lives in the segment: blocks allocated by one
+ * process can be freed or reallocated by another. Every call on the heap
+ * takes the lock. The heap does not grow beyond the segment and has no
+ * maintenance thread.
+ *
+ * Other processes map the segment with mmal_heap_attach_shared(); children
+ * forked after the call inherit the mapping and use the same pointer.
+ * mmal_heap_destroy() unmaps the heap from the calling process only, the
+ * segment goes away with its last mapping and descriptor.
+ * @param size      size of the segment, rounded up to the system page
+ * @param fd        stores the segment descriptor (close-on-exec), owned by
+ *                  the caller; pass it on e.g. over a UNIX socket
+ * @return the heap or NULL if error.
+ */
+mmal_heap_t* mmal_heap_create_shared(size_t size, int* fd);
+
+/**
+ * Map a heap created by mmal_heap_create_shared() in another process. The
+ * segment is mapped at the creator's address, so pointers into the heap
+ * can be passed between the processes as they are; offsets
+ * (mmal_heap_offset()) and the root block work too. The descriptor can be
+ * closed afterwards.
+ * @param fd        descriptor of the segment
+ * @return the heap or NULL if error, fd is not a heap segment or the
+ * address is already used in this process.
+ */
+mmal_heap_t* mmal_heap_attach_shared(int fd);
+
+/**
+ * mmal_aligned_alloc() working on the given heap.
+ * @param heap      heap to allocate from, NULL for the default heap
+ */
+void* mmal_heap_aligned_alloc(mmal_heap_t* heap, size_t alignment, size_t size);
+
+/**
+ * Allocate 'n' blocks of the same size from the default heap at once.
+ * The heap is searched once for the whole batch, so this is cheaper than
+ * 'n' separate mmalloc() calls. Every block is freed with mfree() or
+ * mmal_free_batch().
+ * @param size      requested size of every block
+ * @param n         number of blocks
+ * @param ptrs      array to store 'n' pointers to
+ * @return number of allocated blocks, less than 'n' if error.
+ */
+size_t mmal_malloc_batch(size_t size, size_t n, void** ptrs);
+
+/**
+ * Free an array of blocks of the default heap at once. Each block is
+ * merged with its free neighbours as by mfree(), under a single lock of
+ * the heap; the rest of the heap is not visited.
+ * @param ptrs      pointers to previously allocated data, NULL is skipped
+ * @param n         number of pointers
+ */
+void mmal_free_batch(void** ptrs, size_t n);
+
+/**
+ * Handle of a movable block. The compactor may move the block while it is
+ * not locked, so the program keeps the handle and locks it to get the
+ * current address. Handles are meant for long-lived blocks whose heap
+ * would otherwise fragment, e.g. cache entries.
+ */
+typedef struct mmal_handle* mmal_handle_t;
+
+/**
+ * Allocate a movable block from the default heap.
+ * @param size      requested size for program
+ * @return the handle or NULL if error or size = 0.
+ */
+mmal_handle_t mmal_halloc(size_t size);
+
+/**
+ * mmal_halloc() working on the given heap. Shared and file-backed heaps
+ * have no handles.
+ * @param heap      heap to allocate from, NULL for the default heap
+ */
+mmal_handle_t mmal_heap_halloc(mmal_heap_t* heap, size_t size);
+
+/**
+ * Pin a movable block and return its data. Locks nest; the block does not
+ * move until every lock is released by mmal_hunlock().
+ * @param handle    handle from mmal_halloc()
+ * @return pointer to the data, aligned to MMAL_MIN_ALIGN, NULL if handle
+ * is NULL.
+ */
+void* mmal_hlock(mmal_handle_t handle);
+
+/**
+ * Release one lock of a movable block. Pointers returned by mmal_hlock()
+ * must not be used after the last lock is gone.
+ * @param handle    handle from mmal_halloc()
+ */
+void mmal_hunlock(mmal_handle_t handle);
+
+/**
+ * Free a movable block and its handle, locked or not.
+ * @param handle    handle from mmal_halloc(), NULL is ignored
+ */
+void mmal_hfree(mmal_handle_t handle);
+
+/**
+ * One step of incremental compaction of the default heap. Unlocked
+ * movable blocks are moved to the lowest free space that fits or slid
+ * over the free space in front of them, so free space gathers at the end
+ * of the arenas; arenas emptied this way are unmapped. Every call goes on
+ * where the last one stopped. Other blocks never move.
+ * @param budget    bytes to move in this step, which bounds its time
+ * @return true while the current pass over the heap is not finished.
+ */
+bool mmal_compact(size_t budget);
+
+/**
+ * mmal_compact() working on the given heap.
+ * @param heap      heap to compact, NULL for the default heap
+ */
+bool mmal_heap_compact(mmal_heap_t* heap, size_t budget);
+
+/**
+ * Region (bump-pointer) allocator. Blocks have no header, they cannot be
+ * freed one by one; the whole region is reset or released at once.
+ */
+typedef struct mmal_region mmal_region_t;
+
+/// Keep every arena of the region mapped on mmal_region_reset().
+#define MMAL_REGION_KEEP 0x1
+
+/**
+ * Create a new region. No arena is mapped until the first allocation.
+ * @param flags     0 or MMAL_REGION_KEEP
+ * @return the new region or NULL if error.
+ */
+mmal_region_t* mmal_region_create(unsigned flags);
+
+/**
+ * Allocate memory from a region. The block is aligned to MMAL_REGION_ALIGN.
+ * @param region    region to allocate from
+ * @param size      requested size
+ * @return pointer to allocated data or NULL if error or size = 0.
+ */
+void* mmal_region_alloc(mmal_region_t* region, size_t size);
+
+/**
+ * Free all blocks of a region at once. The region can be used again.
+ * Without MMAL_REGION_KEEP only the first arena stays mapped.
+ * @param region    region to reset
+ */
+void mmal_region_reset(mmal_region_t* region);
+
+/**
+ * Free all blocks of a region and the region itself. Every arena is
+ * unmapped.
+ * @param region    region to release
+ */
+void mmal_region_release(mmal_region_t* region);
+
+/// Alignment of blocks returned by mmal_region_alloc().
+#define MMAL_REGION_ALIGN 16
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MMAL_EXT_H
@@ -0,0 +1,138 @@
+/**
+ * Replacement of the global operator new/delete by mmal.
+ *
+ * Link this file into a program to route every C++ allocation to mmal.
+ * Sized deletes go to mfree_sized(), requests aligned beyond
+ * MMAL_MIN_ALIGN to mmal_aligned_alloc(). To mmal_site_learn() all of them
+ * come from the one or two calls in alloc(), so C++ allocations are
+ * learned and placed together.
+ *
+ * The C interface is not thread-safe, but the C++ runtime and the standard
+ * library call these operators from every thread on their own, so all of
+ * them are serialised through one mutex. A program that calls mmal from
+ * other threads as well, directly or through mmal::allocator, still has to
+ * serialise those calls itself.
+ */
+#include "mmal.hpp"
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+namespace {
+
+std::mutex mmal_lock;
+
+/// Plain new has to be aligned for any fundamental type.
+constexpr std::size_t default_align = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+void* alloc(std::size_t size, std::size_t alignment) noexcept {
+    /// new of 0 bytes must still return a unique pointer
+    if(size == 0) size = 1;
+    std::lock_guard<std::mutex> guard(mmal_lock);
+
+    /// Blocks are naturally aligned to MMAL_MIN_ALIGN. Stricter requests,
+    /// the default alignment included when it is above it, go to
+    /// mmal_aligned_alloc(), which reuses deferred blocks that are aligned
+    /// and keeps runs of such requests aligned without front splits.
+    if(alignment <= MMAL_MIN_ALIGN) return mmalloc(size);
+    return mmal_aligned_alloc(alignment, size);
+}
+
+void* alloc_or_throw(std::size_t size, std::size_t alignment){
+    for(;;){
+        void* ptr = alloc(size, alignment);
+        if(ptr != nullptr) return ptr;
+
+        /// Give the new-handler a chance to release memory
+        std::new_handler handler = std::get_new_handler();
+        if(handler == nullptr) throw std::bad_alloc();
+        handler();
+    }
+}
+
+void release(void* ptr) noexcept {
+    if(ptr == nullptr) return;
+    std::lock_guard<std::mutex> guard(mmal_lock);
+    mfree(ptr);
+}
+
+void release_sized(void* ptr, std::size_t size) noexcept {
+    if(ptr == nullptr) return;
+    std::lock_guard<std::mutex> guard(mmal_lock);
+    mfree_sized(ptr, size != 0 ? size : 1);
+}
+
+} // namespace
+
+/// Throwing variants
+
+void* operator new(std::size_t size){
+    return alloc_or_throw(size, default_align);
+}
+
+void* operator new[](std::size_t size){
+    return alloc_or_throw(size, default_align);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment){
+    return alloc_or_throw(size, static_cast<std::size_t>(alignment));
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment){
+    return alloc_or_throw(size, static_cast<std::size_t>(alignment));
+}
+
+/// Non-throwing variants
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try { return alloc_or_throw(size, default_align); }
+    catch(...) { return nullptr; }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    try { return alloc_or_throw(size, default_align); }
+    catch(...) { return nullptr; }
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept {
+    try { return alloc_or_throw(size, static_cast<std::size_t>(alignment)); }
+    catch(...) { return nullptr; }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept {
+    try { return alloc_or_throw(size, static_cast<std::size_t>(alignment)); }
+    catch(...) { return nullptr; }
+}
+
+/// Deletes
+
+void operator delete(void* ptr) noexcept { release(ptr); }
+void operator delete[](void* ptr) noexcept { release(ptr); }
+
+void operator delete(void* ptr, std::size_t size) noexcept { release_sized(ptr, size); }
+void operator delete[](void* ptr, std::size_t size) noexcept { release_sized(ptr, size); }
+
+void operator delete(void* ptr, std::align_val_t) noexcept { release(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { release(ptr); }
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t) noexcept {
+    release_sized(ptr, size);
+}
+
+void operator delete[](void* ptr, std::size_t size, std::align_val_t) noexcept {
+    release_sized(ptr, size);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { release(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { release(ptr); }
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    release(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    release(ptr);
+}
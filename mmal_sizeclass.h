@@ -0,0 +1,286 @@
+/**
+ * Size classes of small blocks, generated at compile time.
+ *
+ * The table is described by three parameters, override them with -D to
+ * build a variant tuned for a service:
+ *
+ *   MMAL_SC_LG_QUANTUM    log2 of the spacing of the smallest classes, at
+ *                         least 4: a free block keeps two links in its data
+ *   MMAL_SC_LG_NGROUP     log2 of the number of classes per size doubling
+ *   MMAL_SC_LG_MAX_SMALL  log2 of the largest small size
+ *
+ * The first classes are spaced linearly by the quantum up to
+ * NGROUP*QUANTUM. Every following doubling [b, 2b] is split into NGROUP
+ * classes spaced by b/NGROUP. With the defaults (16 B, 4, 4 KiB):
+ *
+ *   16 32 48 64 | 80 96 112 128 | 160 192 224 256 | ... | 2560 ... 4096
+ *
+ * Every value below is an integer constant expression, so the same macros
+ * give 'static const' tables in C and 'constexpr' tables in C++. Mapping
+ * a size to its class is one load from mmal_sc_lookup[], with no division
+ * or branch.
+ */
+#ifndef MMAL_SIZECLASS_H
+#define MMAL_SIZECLASS_H
+
+#include <stddef.h>     // size_t
+#include <stdint.h>     // uint8_t, uint32_t, uint64_t
+
+#ifndef MMAL_SC_LG_QUANTUM
+#define MMAL_SC_LG_QUANTUM 4
+#endif
+
+#ifndef MMAL_SC_LG_NGROUP
+#define MMAL_SC_LG_NGROUP 2
+#endif
+
+#ifndef MMAL_SC_LG_MAX_SMALL
+#define MMAL_SC_LG_MAX_SMALL 12
+#endif
+
+/// End of the linearly spaced part.
+#define MMAL_SC_LG_LINEAR (MMAL_SC_LG_QUANTUM + MMAL_SC_LG_NGROUP)
+
+#if MMAL_SC_LG_QUANTUM < 4 || MMAL_SC_LG_MAX_SMALL > 16 \
+    || MMAL_SC_LG_MAX_SMALL < MMAL_SC_LG_LINEAR \
+    || MMAL_SC_LG_MAX_SMALL - MMAL_SC_LG_QUANTUM > 10 \
+    || MMAL_SC_LG_NGROUP > 3
+#error "unsupported size class parameters"
+#endif
+
+#define MMAL_SC_QUANTUM   ((size_t)1 << MMAL_SC_LG_QUANTUM)
+#define MMAL_SC_NGROUP    (1 << MMAL_SC_LG_NGROUP)
+#define MMAL_SC_MAX_SMALL ((size_t)1 << MMAL_SC_LG_MAX_SMALL)
+
+/// Number of classes (the preprocessor form is usable in #if).
+#define MMAL_SC_NCLASSES_PP \
+    (MMAL_SC_NGROUP * (1 + MMAL_SC_LG_MAX_SMALL - MMAL_SC_LG_LINEAR))
+#define MMAL_SC_NCLASSES ((unsigned)MMAL_SC_NCLASSES_PP)
+
+/// Length of the size-to-class table, one entry per quantum.
+#define MMAL_SC_NLOOKUP_PP ((1 << (MMAL_SC_LG_MAX_SMALL - MMAL_SC_LG_QUANTUM)) + 1)
+#define MMAL_SC_NLOOKUP ((size_t)MMAL_SC_NLOOKUP_PP)
+
+/// The tables are generated in chunks, their arrays are padded to them.
+#define MMAL_SC_INFO_LEN_   ((MMAL_SC_NCLASSES_PP + 7) / 8 * 8)
+#define MMAL_SC_LOOKUP_LEN_ ((MMAL_SC_NLOOKUP_PP + 63) / 64 * 64)
+
+/// Runs are made of pages of this size.
+#define MMAL_SC_RUN_PAGE 4096
+
+/* ------------------------------------------------------------------------ */
+/* Formulas                                                                 */
+/* ------------------------------------------------------------------------ */
+
+/// floor(log2(x)) for 1 <= x < 65536 as a constant expression.
+#define MMAL_SC_LG2_(x)  ((x) >= 2 ? 1 : 0)
+#define MMAL_SC_LG4_(x)  ((x) >= 4 ? 2 + MMAL_SC_LG2_((x) >> 2) : MMAL_SC_LG2_(x))
+#define MMAL_SC_LG8_(x)  ((x) >= 16 ? 4 + MMAL_SC_LG4_((x) >> 4) : MMAL_SC_LG4_(x))
+#define MMAL_SC_LG16_(x) ((x) >= 256 ? 8 + MMAL_SC_LG8_((x) >> 8) : MMAL_SC_LG8_(x))
+
+/// Size of class 'i'.
+#define MMAL_SC_SIZE(i) \
+    ((i) < MMAL_SC_NGROUP \
+        ? ((size_t)(i) + 1) << MMAL_SC_LG_QUANTUM \
+        : ((size_t)(MMAL_SC_NGROUP + 1 + ((i) - MMAL_SC_NGROUP) % MMAL_SC_NGROUP)) \
+            << (MMAL_SC_LG_QUANTUM + ((i) - MMAL_SC_NGROUP) / MMAL_SC_NGROUP))
+
+/// Class of size 'sz' > NGROUP*QUANTUM. 'lg' is the doubling sz falls into.
+#define MMAL_SC_GEOM_LG_(sz) MMAL_SC_LG16_((sz) - 1)
+#define MMAL_SC_GEOM_CLASS_(sz) \
+    (MMAL_SC_NGROUP * (MMAL_SC_GEOM_LG_(sz) - MMAL_SC_LG_LINEAR + 1) \
+     + (((sz) - ((size_t)1 << MMAL_SC_GEOM_LG_(sz)) - 1) \
+        >> (MMAL_SC_GEOM_LG_(sz) - MMAL_SC_LG_NGROUP)))
+
+/// Smallest class holding 's' quanta.
+#define MMAL_SC_CLASS_OF_QUANTA(s) \
+    ((s) <= MMAL_SC_NGROUP \
+        ? ((s) > 0 ? (s) - 1 : 0) \
+        : MMAL_SC_GEOM_CLASS_((size_t)(s) << MMAL_SC_LG_QUANTUM))
+
+/// A run of 'p' pages wastes at most 1/8 of its space on class size 'sz'.
+#define MMAL_SC_RUN_FITS_(sz, p) \
+    ((((p)*MMAL_SC_RUN_PAGE) % (sz)) * 8 <= (p)*MMAL_SC_RUN_PAGE)
+
+/// Size of a run of class size 'sz': the fewest pages (up to 8) that fit.
+/// A class larger than 8 pages gets a run of one block, in whole pages.
+#define MMAL_SC_RUN_SIZE(sz) \
+    ((sz) > 8*MMAL_SC_RUN_PAGE \
+        ? ((sz) + MMAL_SC_RUN_PAGE-1) / MMAL_SC_RUN_PAGE * MMAL_SC_RUN_PAGE \
+        : MMAL_SC_RUN_PAGE * (MMAL_SC_RUN_FITS_(sz, 1) ? 1 : MMAL_SC_RUN_FITS_(sz, 2) ? 2 \
+                            : MMAL_SC_RUN_FITS_(sz, 3) ? 3 : MMAL_SC_RUN_FITS_(sz, 4) ? 4 \
+                            : MMAL_SC_RUN_FITS_(sz, 5) ? 5 : MMAL_SC_RUN_FITS_(sz, 6) ? 6 \
+                            : MMAL_SC_RUN_FITS_(sz, 7) ? 7 : 8))
+
+/// ceil(2^32 / sz): offset / sz == (offset * recip) >> 32 for offsets in a run.
+#define MMAL_SC_RECIP(sz) ((uint32_t)((((uint64_t)1 << 32) + (sz) - 1) / (sz)))
+
+/* ------------------------------------------------------------------------ */
+/* Tables                                                                   */
+/* ------------------------------------------------------------------------ */
+
+#ifdef __cplusplus
+#define MMAL_SC_TABLE constexpr
+#define MMAL_SC_FUNC  static constexpr inline
+#else
+#define MMAL_SC_TABLE static const
+#define MMAL_SC_FUNC  static inline
+#endif
+
+/**
+ * Description of one size class.
+ */
+typedef struct mmal_sc_info {
+    uint32_t size;      ///< class size in bytes
+    uint32_t run_size;  ///< bytes in one run of this class
+    uint32_t slots;     ///< blocks per run
+    uint32_t recip;     ///< MMAL_SC_RECIP(size)
+} mmal_sc_info_t;
+
+#define MMAL_SC_REP8_(M, b) \
+    M((b)+0) M((b)+1) M((b)+2) M((b)+3) M((b)+4) M((b)+5) M((b)+6) M((b)+7)
+#define MMAL_SC_REP64_(M, b) \
+    MMAL_SC_REP8_(M, (b)+0)  MMAL_SC_REP8_(M, (b)+8)  MMAL_SC_REP8_(M, (b)+16) \
+    MMAL_SC_REP8_(M, (b)+24) MMAL_SC_REP8_(M, (b)+32) MMAL_SC_REP8_(M, (b)+40) \
+    MMAL_SC_REP8_(M, (b)+48) MMAL_SC_REP8_(M, (b)+56)
+
+#define MMAL_SC_INFO_(i) \
+    { (uint32_t)MMAL_SC_SIZE(i), (uint32_t)MMAL_SC_RUN_SIZE(MMAL_SC_SIZE(i)), \
+      (uint32_t)(MMAL_SC_RUN_SIZE(MMAL_SC_SIZE(i)) / MMAL_SC_SIZE(i)), \
+      MMAL_SC_RECIP(MMAL_SC_SIZE(i)) },
+
+#define MMAL_SC_LOOKUP_(s) (uint8_t)MMAL_SC_CLASS_OF_QUANTA(s),
+
+/// Class table, indexed by class. Entries from MMAL_SC_NCLASSES are padding.
+MMAL_SC_TABLE mmal_sc_info_t mmal_sc_info[MMAL_SC_INFO_LEN_] = {
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 0)
+#if MMAL_SC_NCLASSES_PP > 8
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 8)
+#endif
+#if MMAL_SC_NCLASSES_PP > 16
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 16)
+#endif
+#if MMAL_SC_NCLASSES_PP > 24
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 24)
+#endif
+#if MMAL_SC_NCLASSES_PP > 32
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 32)
+#endif
+#if MMAL_SC_NCLASSES_PP > 40
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 40)
+#endif
+#if MMAL_SC_NCLASSES_PP > 48
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 48)
+#endif
+#if MMAL_SC_NCLASSES_PP > 56
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 56)
+#endif
+#if MMAL_SC_NCLASSES_PP > 64
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 64)
+#endif
+#if MMAL_SC_NCLASSES_PP > 72
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 72)
+#endif
+#if MMAL_SC_NCLASSES_PP > 80
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 80)
+#endif
+#if MMAL_SC_NCLASSES_PP > 88
+    MMAL_SC_REP8_(MMAL_SC_INFO_, 88)
+#endif
+#if MMAL_SC_NCLASSES_PP > 96
+#error "too many size classes"
+#endif
+};
+
+/**
+ * Size-to-class table, indexed by the size rounded up to quanta. Entries
+ * from MMAL_SC_NLOOKUP are padding.
+ */
+MMAL_SC_TABLE uint8_t mmal_sc_lookup[MMAL_SC_LOOKUP_LEN_] = {
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 0)
+#if MMAL_SC_NLOOKUP_PP > 64
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 64)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 128
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 128)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 192
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 192)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 256
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 256)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 320
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 320)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 384
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 384)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 448
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 448)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 512
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 512)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 576
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 576)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 640
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 640)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 704
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 704)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 768
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 768)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 832
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 832)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 896
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 896)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 960
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 960)
+#endif
+#if MMAL_SC_NLOOKUP_PP > 1024
+    MMAL_SC_REP64_(MMAL_SC_LOOKUP_, 1024)
+#endif
+};
+
+/**
+ * Class of a small size.
+ * @pre 0 < size <= MMAL_SC_MAX_SMALL
+ */
+MMAL_SC_FUNC
+unsigned mmal_sc_index(size_t size){
+    return mmal_sc_lookup[(size + MMAL_SC_QUANTUM-1) >> MMAL_SC_LG_QUANTUM];
+}
+
+/**
+ * Size of the class a small size is rounded up to.
+ * @pre 0 < size <= MMAL_SC_MAX_SMALL
+ */
+MMAL_SC_FUNC
+size_t mmal_sc_round(size_t size){
+    return mmal_sc_info[mmal_sc_index(size)].size;
+}
+
+/**
+ * Index of the slot containing byte 'offset' of a run of class 'sc',
+ * computed by a multiplication instead of a division.
+ * @pre offset < mmal_sc_info[sc].run_size
+ */
+MMAL_SC_FUNC
+uint32_t mmal_sc_slot(unsigned sc, uint32_t offset){
+    return (uint32_t)(((uint64_t)offset * mmal_sc_info[sc].recip) >> 32);
+}
+
+#ifdef __cplusplus
+static_assert(mmal_sc_info[MMAL_SC_NCLASSES-1].size == MMAL_SC_MAX_SMALL,
+              "the last class must be the largest small size");
+static_assert(mmal_sc_round(1) == MMAL_SC_QUANTUM, "smallest class");
+static_assert(mmal_sc_round(MMAL_SC_MAX_SMALL) == MMAL_SC_MAX_SMALL, "largest class");
+#endif
+
+#endif // MMAL_SIZECLASS_H
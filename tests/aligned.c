@@ -0,0 +1,89 @@
+/**
+ * Regression tests of aligned allocation, the path of C++ operator new:
+ * sizes close to SIZE_MAX, alignment and reuse of deferred blocks.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/aligned.c mmal.c -o test_aligned -lpthread && ./test_aligned
+ */
+#include <stdint.h>
+
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+/**
+ * Sizes close to SIZE_MAX must fail instead of wrapping around to a
+ * small block.
+ */
+static
+void test_overflow(void){
+    void* keep = mmalloc(100);
+    CHECK(keep != NULL);
+    for(size_t d = 0; d < 256; d++){
+        CHECK(mmalloc(SIZE_MAX - d) == NULL);
+        CHECK(mrealloc(keep, SIZE_MAX - d) == NULL);
+        CHECK(mmal_aligned_alloc(16, SIZE_MAX - d) == NULL);
+        CHECK(mmal_aligned_alloc(64, SIZE_MAX - d) == NULL);
+        CHECK(mmal_aligned_alloc(4096, SIZE_MAX - d) == NULL);
+        CHECK(!mmal_try_expand(keep, SIZE_MAX - d));
+    }
+    CHECK(mmal_aligned_alloc(64, SIZE_MAX/2) == NULL);
+    CHECK(mmal_aligned_alloc(3, 100) == NULL);
+
+    /// The failed calls left the block and the heap alone
+    test_fill(keep, 100, 7);
+    void* other = mmalloc(100);
+    CHECK(other != NULL && other != keep);
+    CHECK(test_holds(keep, 100, 7));
+    mfree(other);
+    mfree(keep);
+}
+
+/**
+ * Aligned blocks are aligned, do not overlap and go back with mfree().
+ */
+static
+void test_aligned(void){
+    enum { N = 300 };
+    static void* ptrs[N];
+    uint64_t seed = 1;
+    for(size_t i = 0; i < N; i++){
+        size_t alignment = (size_t)16 << (test_rnd(&seed) % 9);
+        size_t size = test_rnd(&seed) % 3000 + 1;
+        ptrs[i] = mmal_aligned_alloc(alignment, size);
+        CHECK(ptrs[i] != NULL);
+        CHECK(((uintptr_t)ptrs[i] & (alignment-1)) == 0);
+        CHECK(mmal_usable_size(ptrs[i]) >= size);
+        test_fill(ptrs[i], size, (unsigned)i);
+        CHECK(test_holds(ptrs[i], size, (unsigned)i));
+        if(i % 3 == 0){
+            mfree(ptrs[i]);
+            ptrs[i] = NULL;
+        }
+    }
+    for(size_t i = 0; i < N; i++) mfree(ptrs[i]);
+
+    /// In deferred mode an aligned block is reused by the next aligned
+    /// request of its class, an unaligned one is not handed out for it
+    mmal_heap_t* heap = mmal_heap_create();
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_DEFER_BYTES, 1 << 16));
+    void* a = mmal_heap_aligned_alloc(heap, 16, 40);
+    void* b = mmal_heap_aligned_alloc(heap, 16, 40);
+    void* guard = mmal_heap_aligned_alloc(heap, 16, 40);
+    CHECK(a != NULL && b != NULL && guard != NULL);
+    mmal_heap_free(heap, a);
+    mmal_heap_free(heap, b);
+    CHECK(mmal_heap_aligned_alloc(heap, 16, 40) == b);
+    void* c = mmal_heap_aligned_alloc(heap, 4096, 40);
+    CHECK(c != a && ((uintptr_t)c & 4095) == 0);
+    mmal_heap_free(heap, b);
+    mmal_heap_free(heap, c);
+    mmal_heap_free(heap, guard);
+    mmal_heap_destroy(heap);
+}
+
+int main(void){
+    RUN(test_overflow);
+    RUN(test_aligned);
+    return 0;
+}
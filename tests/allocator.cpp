@@ -0,0 +1,90 @@
+/**
+ * Regression tests of the C++ interface of mmal.hpp: mmal::allocator in
+ * standard containers and mmal::heap_resource under std::pmr.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. -c mmal.c -o mmal.o
+ *   c++ -std=c++17 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/allocator.cpp mmal_new.cpp mmal.o -o test_allocator -lpthread \
+ *      && ./test_allocator
+ */
+#include <cstdint>
+#include <list>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "mmal.hpp"
+#include "test.h"
+
+struct alignas(64) line {
+    unsigned char bytes[64];
+};
+
+/**
+ * Containers on mmal::allocator keep their elements, over-aligned types
+ * included. allocate_at_least() reports the whole usable block, and the
+ * sized deallocate() of all of it frees the block.
+ */
+static
+void test_allocator(void){
+    std::vector<unsigned, mmal::allocator<unsigned>> numbers;
+    for(unsigned i = 0; i < 100000; i++) numbers.push_back(i * 7);
+    for(unsigned i = 0; i < 100000; i++) CHECK(numbers[i] == i * 7);
+
+    std::list<int, mmal::allocator<int>> nodes(1000, 5);
+    CHECK(nodes.size() == 1000 && nodes.front() == 5);
+
+    std::vector<line, mmal::allocator<line>> lines(33);
+    CHECK(((uintptr_t)lines.data() & 63) == 0);
+
+    mmal::allocator<unsigned> alloc;
+    mmal::allocation_result<unsigned*> got = alloc.allocate_at_least(10);
+    CHECK(got.ptr != nullptr && got.count >= 10);
+    CHECK(got.count == mmal_usable_size(got.ptr) / sizeof(unsigned));
+    test_fill(got.ptr, got.count * sizeof(unsigned), 9);
+    CHECK(test_holds(got.ptr, got.count * sizeof(unsigned), 9));
+
+    /// mfree_sized() checks the size against the block in debug builds
+    alloc.deallocate(got.ptr, got.count);
+    unsigned* again = alloc.allocate(10);
+    CHECK(again == got.ptr);
+    alloc.deallocate(again, 10);
+    CHECK(alloc == mmal::allocator<line>());
+}
+
+/**
+ * A heap_resource serves pmr containers and aligned requests from its own
+ * heap, a borrowed one from the heap it was given.
+ */
+static
+void test_resource(void){
+    mmal::heap_resource own;
+    CHECK(own.heap() != nullptr && mmal_heap_mapped_bytes(own.heap()) == 0);
+    {
+        std::pmr::vector<std::pmr::string> words(&own);
+        for(int i = 0; i < 2000; i++)
+            words.emplace_back(std::string(40 + i % 50, (char)('a' + i % 26)));
+        for(int i = 0; i < 2000; i++)
+            CHECK(std::string_view(words[i]) == std::string(40 + i % 50, (char)('a' + i % 26)));
+        CHECK(words[0].get_allocator().resource() == &own);
+        CHECK(mmal_heap_mapped_bytes(own.heap()) > 0);
+    }
+
+    void* aligned = own.allocate(100, 256);
+    CHECK(aligned != nullptr && ((uintptr_t)aligned & 255) == 0);
+    own.deallocate(aligned, 100, 256);
+
+    mmal::heap_resource borrowed(nullptr);
+    CHECK(borrowed.heap() == nullptr && !borrowed.is_equal(own) && borrowed.is_equal(borrowed));
+    std::pmr::vector<int> numbers({ 1, 2, 3 }, &borrowed);
+    numbers.resize(10000, 4);
+    CHECK(numbers[2] == 3 && numbers[9999] == 4);
+}
+
+int main(void){
+    RUN(test_allocator);
+    RUN(test_resource);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/**
+ * Regression tests of arena mapping: the maintenance pass and thread,
+ * reservations and huge pages.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/arena.c mmal.c -o test_arena -lpthread && ./test_arena
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+/**
+ * The maintenance pass unmaps arenas free for MMAL_OPT_RETAIN_MS and keeps
+ * MMAL_OPT_SPARE_BYTES mapped; the thread does the same in the background.
+ */
+static
+void test_maintenance(void){
+    mmal_heap_t* heap = mmal_heap_create();
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_RETAIN_MS, 0));
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_DECAY_MS, 0));
+    void* ptr = mmal_heap_malloc(heap, 1 << 20);
+    CHECK(ptr != NULL && mmal_heap_mapped_bytes(heap) > 0);
+    mmal_heap_free(heap, ptr);
+    mmal_heap_maintain(heap);
+    CHECK(mmal_heap_mapped_bytes(heap) == 0);
+
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_SPARE_BYTES, 1 << 20));
+    mmal_heap_maintain(heap);
+    CHECK(mmal_heap_mapped_bytes(heap) >= 1 << 20);
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_SPARE_BYTES, 0));
+
+    CHECK(mmal_heap_maintenance_start(heap, 1));
+    CHECK(!mmal_heap_maintenance_start(heap, 1));
+    uint64_t seed = 5;
+    for(int round = 0; round < 200; round++){
+        void* ptrs[64];
+        for(int i = 0; i < 64; i++){
+            size_t size = test_rnd(&seed) % 20000 + 1;
+            ptrs[i] = mmal_heap_malloc(heap, size);
+            CHECK(ptrs[i] != NULL);
+            memset(ptrs[i], round, size);
+        }
+        for(int i = 0; i < 64; i++) mmal_heap_free(heap, ptrs[i]);
+    }
+    mmal_heap_maintenance_stop(heap);
+    mmal_heap_maintain(heap);
+    CHECK(mmal_heap_mapped_bytes(heap) == 0);
+    mmal_heap_destroy(heap);
+}
+
+/**
+ * A reservation is free space the next allocations take without mapping.
+ */
+static
+void test_reserve(void){
+    mmal_heap_t* heap = mmal_heap_create();
+    CHECK(!mmal_heap_reserve(heap, 0, 0));
+    CHECK(mmal_heap_reserve(heap, 4 << 20, MMAL_RESERVE_POPULATE));
+    size_t mapped = mmal_heap_mapped_bytes(heap);
+    CHECK(mapped >= 4 << 20);
+    for(int i = 0; i < 3; i++) CHECK(mmal_heap_malloc(heap, 1 << 20) != NULL);
+    CHECK(mmal_heap_mapped_bytes(heap) == mapped);
+    mmal_heap_destroy(heap);
+}
+
+/**
+ * MMAL_OPT_HUGEPAGE maps arenas 2 MiB aligned in whole 2 MiB units. The
+ * advice may be refused when the system has no transparent huge pages,
+ * the arenas work the same.
+ */
+static
+void test_hugepage(void){
+    const size_t huge = (size_t)2 << 20;
+    mmal_heap_t* heap = mmal_heap_create();
+    CHECK(!mmal_heap_setopt(heap, MMAL_OPT_HUGEPAGE, 2));
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_HUGEPAGE, 1));
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_RETAIN_MS, 0));
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_DECAY_MS, 0));
+
+    /// The first block of a fresh arena sits right after its start
+    char* small = mmal_heap_malloc(heap, 100);
+    CHECK(small != NULL && ((uintptr_t)small & (huge-1)) < 4096);
+    CHECK(mmal_heap_mapped_bytes(heap) == huge);
+
+    char* big = mmal_heap_malloc(heap, 3 << 20);
+    CHECK(big != NULL && ((uintptr_t)big & (huge-1)) < 4096);
+    CHECK(mmal_heap_mapped_bytes(heap) % huge == 0);
+    CHECK(mmal_heap_mapped_bytes(heap) >= huge + (3 << 20));
+    test_fill(small, 100, 1);
+    test_fill(big, 3 << 20, 2);
+    CHECK(test_holds(small, 100, 1) && test_holds(big, 3 << 20, 2));
+
+    mmal_heap_free(heap, big);
+    mmal_heap_free(heap, small);
+    mmal_heap_maintain(heap);
+    CHECK(mmal_heap_mapped_bytes(heap) == 0);
+
+    /// The heap maps again after its arenas are gone
+    small = mmal_heap_malloc(heap, 100);
+    CHECK(small != NULL && ((uintptr_t)small & (huge-1)) < 4096);
+    mmal_heap_destroy(heap);
+}
+
+int main(void){
+    RUN(test_maintenance);
+    RUN(test_reserve);
+    RUN(test_hugepage);
+    return 0;
+}
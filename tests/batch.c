@@ -0,0 +1,32 @@
+/**
+ * Regression tests of the batch allocation and free API.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/batch.c mmal.c -o test_batch -lpthread && ./test_batch
+ */
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+/**
+ * Batches hand out distinct blocks that are freed together.
+ */
+static
+void test_batch(void){
+    enum { N = 500 };
+    static void* ptrs[N];
+    CHECK(mmal_malloc_batch(48, N, ptrs) == N);
+    for(size_t i = 0; i < N; i++){
+        CHECK(ptrs[i] != NULL && mmal_usable_size(ptrs[i]) >= 48);
+        test_fill(ptrs[i], 48, (unsigned)i);
+    }
+    for(size_t i = 0; i < N; i++) CHECK(test_holds(ptrs[i], 48, (unsigned)i));
+    mfree(ptrs[N/2]);
+    ptrs[N/2] = NULL;
+    mmal_free_batch(ptrs, N);
+}
+
+int main(void){
+    RUN(test_batch);
+    return 0;
+}
@@ -0,0 +1,50 @@
+/**
+ * Regression tests of the streaming copy of moved blocks
+ * (MMAL_OPT_STREAM_COPY).
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/copy.c mmal.c -o test_copy -lpthread && ./test_copy
+ */
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+/**
+ * With the threshold at one byte every move of mrealloc() takes the
+ * streaming copy. Sizes around the vector and loop widths, and blocks
+ * starting at every 8-byte offset of a cache line, keep their contents
+ * byte for byte.
+ */
+static
+void test_stream(void){
+    static const size_t sizes[] = {
+        1, 7, 8, 31, 33, 63, 65, 127, 129, 255, 257, 300, 511, 513,
+        1000, 4097, 65535, 100003, 1 << 20, (1 << 20) + 77,
+    };
+    unsigned tag = 0;
+    for(size_t k = 0; k < sizeof(sizes)/sizeof(sizes[0]); k++){
+        for(size_t shift = 0; shift < 64; shift += 8){
+            size_t size = sizes[k];
+            mmal_heap_t* heap = mmal_heap_create();
+            CHECK(mmal_heap_setopt(heap, MMAL_OPT_STREAM_COPY, 1));
+
+            /// The spacer moves the block and its later copy in the line
+            char* spacer = mmal_heap_malloc(heap, 16 + shift);
+            char* ptr = mmal_heap_malloc(heap, size);
+            char* guard = mmal_heap_malloc(heap, 16);
+            CHECK(spacer != NULL && ptr != NULL && guard != NULL);
+            test_fill(ptr, size, ++tag);
+
+            /// The guard keeps the block from growing in place
+            char* moved = mmal_heap_realloc(heap, ptr, mmal_usable_size(ptr) + size + shift);
+            CHECK(moved != NULL && moved != ptr);
+            CHECK(test_holds(moved, size, tag));
+            mmal_heap_destroy(heap);
+        }
+    }
+}
+
+int main(void){
+    RUN(test_stream);
+    return 0;
+}
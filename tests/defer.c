@@ -0,0 +1,48 @@
+/**
+ * Regression tests of deferred coalescing.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/defer.c mmal.c -o test_defer -lpthread && ./test_defer
+ */
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+/**
+ * MMAL_OPT_DEFER_BYTES keeps freed blocks unmerged until the maintenance
+ * pass consolidates them.
+ */
+static
+void test_defer(void){
+    for(int mode = 0; mode < 3; mode++){
+        mmal_heap_t* heap = mmal_heap_create();
+        if(mode > 0) CHECK(mmal_heap_setopt(heap, MMAL_OPT_DEFER_BYTES, 1 << 16));
+        void* a = mmal_heap_malloc(heap, 64);
+        void* b = mmal_heap_malloc(heap, 64);
+        void* guard = mmal_heap_malloc(heap, 64);
+        CHECK(a != NULL && b != NULL && guard != NULL);
+        mmal_heap_free(heap, a);
+        mmal_heap_free(heap, b);
+        if(mode == 2) mmal_heap_maintain(heap);
+
+        /// Only the merged pair has room for this
+        void* pair = mmal_heap_malloc(heap, 120);
+        CHECK(mode == 1 ? pair != a : pair == a);
+        mmal_heap_destroy(heap);
+    }
+
+    /// A deferred block is reused by the next request of its class
+    mmal_heap_t* heap = mmal_heap_create();
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_DEFER_BYTES, 1 << 16));
+    void* a = mmal_heap_malloc(heap, 64);
+    void* guard = mmal_heap_malloc(heap, 64);
+    mmal_heap_free(heap, a);
+    CHECK(mmal_heap_malloc(heap, 64) == a);
+    mmal_heap_free(heap, guard);
+    mmal_heap_destroy(heap);
+}
+
+int main(void){
+    RUN(test_defer);
+    return 0;
+}
@@ -0,0 +1,126 @@
+/**
+ * Regression tests of file-backed heaps reopened at the same or at
+ * another address.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/file.c mmal.c -o test_file -lpthread && ./test_file
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+#define NODES 1000
+
+/**
+ * List node stored in a file heap, linked both by pointer and by offset.
+ */
+typedef struct node {
+    struct node* next;
+    size_t next_offset;
+    unsigned value;
+    char pad[100];
+} Node;
+
+/**
+ * A file heap keeps its blocks across close and open. Reopened where it
+ * was, pointers stay valid; relocated, offsets do and the heap itself
+ * works.
+ */
+static
+void test_file(void){
+    char path[] = "/tmp/mmal_test_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    mmal_heap_t* heap = mmal_heap_open_file(path, 1 << 20);
+    CHECK(heap != NULL);
+    CHECK(mmal_heap_open_file(path, 1 << 20) == NULL);
+    CHECK(mmal_heap_root(heap) == NULL);
+
+    Node* head = NULL;
+    size_t head_offset = 0;
+    for(unsigned i = 0; i < NODES; i++){
+        Node* node = mmal_heap_malloc(heap, sizeof(Node));
+        CHECK(node != NULL);
+        node->value = i;
+        node->next = head;
+        node->next_offset = head_offset;
+        head = node;
+        head_offset = mmal_heap_offset(heap, node);
+        CHECK(mmal_heap_at(heap, head_offset) == node);
+    }
+    /// The heap does not grow beyond its file
+    CHECK(mmal_heap_malloc(heap, 2 << 20) == NULL);
+    CHECK(mmal_heap_set_root(heap, head));
+    CHECK(mmal_heap_sync(heap));
+    mmal_heap_destroy(heap);
+
+    /// Same address: pointers are valid
+    heap = mmal_heap_open_file(path, 0);
+    CHECK(heap != NULL);
+    Node* node = mmal_heap_root(heap);
+    CHECK(node == head);
+    for(unsigned i = NODES; i-- > 0; node = node->next) CHECK(node->value == i);
+    CHECK(node == NULL);
+    mmal_heap_destroy(heap);
+
+    /// Occupy the old address: the heap is relocated, offsets are valid
+    void* page = (void*)((uintptr_t)head & ~(uintptr_t)4095);
+    void* blocker = mmap(page, 4096, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED_NOREPLACE, -1, 0);
+    CHECK(blocker == page);
+    heap = mmal_heap_open_file(path, 0);
+    CHECK(heap != NULL);
+    node = mmal_heap_root(heap);
+    CHECK(node != NULL && node != head);
+    for(unsigned i = NODES; i-- > 0; node = mmal_heap_at(heap, node->next_offset))
+        CHECK(node->value == i);
+    CHECK(node == NULL);
+
+    /// The relocated heap allocates and frees as usual
+    uint64_t seed = 9;
+    for(int round = 0; round < 3; round++){
+        void* ptrs[100];
+        size_t sizes[100];
+        for(int i = 0; i < 100; i++){
+            sizes[i] = test_rnd(&seed) % 3000 + 1;
+            ptrs[i] = mmal_heap_malloc(heap, sizes[i]);
+            CHECK(ptrs[i] != NULL);
+            test_fill(ptrs[i], sizes[i], (unsigned)i);
+        }
+        for(int i = 0; i < 100; i++){
+            CHECK(test_holds(ptrs[i], sizes[i], (unsigned)i));
+            mmal_heap_free(heap, ptrs[i]);
+        }
+    }
+    mmal_heap_destroy(heap);
+    munmap(blocker, 4096);
+
+    heap = mmal_heap_open_file(path, 0);
+    CHECK(heap != NULL);
+    node = mmal_heap_root(heap);
+    CHECK(node != NULL && node->value == NODES-1);
+    mmal_heap_destroy(heap);
+    unlink(path);
+
+    /// Not a heap file
+    strcpy(path, "/tmp/mmal_test_XXXXXX");
+    fd = mkstemp(path);
+    CHECK(fd >= 0);
+    CHECK(write(fd, "not a heap, just some text in a file", 36) == 36);
+    close(fd);
+    CHECK(mmal_heap_open_file(path, 0) == NULL);
+    unlink(path);
+}
+
+int main(void){
+    RUN(test_file);
+    return 0;
+}
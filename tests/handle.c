@@ -0,0 +1,115 @@
+/**
+ * Regression tests of movable blocks: handles, the compactor and the
+ * handles of destroyed heaps. The handle table is made small so that
+ * running out of handles is cheap to reach:
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -DMMAL_HANDLE_MAX=4096 -I. tests/handle.c mmal.c -o test_handle -lpthread \
+ *      && ./test_handle
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+/// mmal.c must be built with the same small table, `make check` does so
+#ifndef MMAL_HANDLE_MAX
+#error "build tests/handle.c and mmal.c with -DMMAL_HANDLE_MAX=4096"
+#endif
+
+#define N 3000
+
+static mmal_handle_t handles[N];
+static size_t sizes[N];
+
+/**
+ * Every movable block still holds its pattern.
+ */
+static
+void check_handles(void){
+    for(size_t i = 0; i < N; i++){
+        if(handles[i] == NULL) continue;
+        void* data = mmal_hlock(handles[i]);
+        CHECK(((uintptr_t)data & (MMAL_MIN_ALIGN-1)) == 0);
+        CHECK(test_holds(data, sizes[i], (unsigned)i));
+        mmal_hunlock(handles[i]);
+    }
+}
+
+/**
+ * The compactor moves unlocked blocks down, keeps their contents, leaves
+ * locked blocks in place and unmaps arenas it empties.
+ */
+static
+void test_compact(void){
+    for(int use_default = 0; use_default <= 1; use_default++){
+        mmal_heap_t* heap = use_default ? NULL : mmal_heap_create();
+        uint64_t seed = 3;
+        for(size_t i = 0; i < N; i++){
+            sizes[i] = test_rnd(&seed) % 3000 + 1;
+            handles[i] = mmal_heap_halloc(heap, sizes[i]);
+            CHECK(handles[i] != NULL);
+            test_fill(mmal_hlock(handles[i]), sizes[i], (unsigned)i);
+            mmal_hunlock(handles[i]);
+        }
+        for(size_t i = 0; i < N; i++){
+            if(i % 4 != 0){
+                mmal_hfree(handles[i]);
+                handles[i] = NULL;
+            }
+        }
+
+        /// Pin a few blocks, they must not move
+        void* pinned[N/100+1];
+        for(size_t i = 0; i < N; i += 100) pinned[i/100] = mmal_hlock(handles[i]);
+
+        size_t mapped = mmal_heap_mapped_bytes(heap);
+        int steps = 0;
+        while(mmal_heap_compact(heap, 1 << 16)){
+            if(++steps % 5 == 0) check_handles();
+        }
+        check_handles();
+        CHECK(mmal_heap_mapped_bytes(heap) < mapped);
+        for(size_t i = 0; i < N; i += 100){
+            CHECK(mmal_hlock(handles[i]) == pinned[i/100]);
+            mmal_hunlock(handles[i]);
+            mmal_hunlock(handles[i]);
+        }
+
+        for(size_t i = 0; i < N; i++){
+            mmal_hfree(handles[i]);
+            handles[i] = NULL;
+        }
+        if(heap != NULL) mmal_heap_destroy(heap);
+    }
+    mmal_hfree(NULL);
+    CHECK(mmal_hlock(NULL) == NULL);
+    CHECK(mmal_halloc(0) == NULL);
+}
+
+/**
+ * Destroying a heap releases the handles of its blocks, so the table does
+ * not run out over repeated create/destroy cycles.
+ */
+static
+void test_destroy(void){
+    for(int round = 0; round < 3; round++){
+        mmal_heap_t* heap = mmal_heap_create();
+        for(size_t i = 0; i < MMAL_HANDLE_MAX; i++){
+            mmal_handle_t handle = mmal_heap_halloc(heap, 32);
+            CHECK(handle != NULL);
+            memset(mmal_hlock(handle), 1, 32);
+            mmal_hunlock(handle);
+        }
+        CHECK(mmal_heap_halloc(heap, 32) == NULL);
+        mmal_heap_destroy(heap);
+    }
+}
+
+int main(void){
+    RUN(test_compact);
+    RUN(test_destroy);
+    return 0;
+}
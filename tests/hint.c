@@ -0,0 +1,118 @@
+/**
+ * Regression tests of lifetime hints: the blocks of mmal_malloc_hint()
+ * live in their own pools and every default-heap call finds their owner.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/hint.c mmal.c -o test_hint -lpthread && ./test_hint
+ */
+#include <stdbool.h>
+
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+#define N 200
+
+/**
+ * Whether 'ptr' is one of the first 'n' pointers of 'ptrs'.
+ */
+static
+bool test_among(void* ptr, void** ptrs, size_t n){
+    for(size_t i = 0; i < n; i++) if(ptrs[i] == ptr) return true;
+    return false;
+}
+
+/**
+ * mmal_free_batch() returns hint blocks to their pools, also while the
+ * default heap has no arena of its own. Runs first, before anything else
+ * maps the default heap.
+ */
+static
+void test_batch(void){
+    static void* ptrs[N];
+    static void* again[N];
+    CHECK(mmal_heap_mapped_bytes(NULL) == 0);
+    for(unsigned hints = MMAL_SHORT_LIVED; hints <= MMAL_LONG_LIVED; hints++){
+        for(size_t i = 0; i < N; i++){
+            ptrs[i] = mmal_malloc_hint(64, hints);
+            CHECK(ptrs[i] != NULL);
+        }
+        mmal_free_batch(ptrs, N);
+        for(size_t i = 0; i < N; i++){
+            again[i] = mmal_malloc_hint(64, hints);
+            CHECK(test_among(again[i], ptrs, N));
+        }
+        mmal_free_batch(again, N);
+    }
+    CHECK(mmal_heap_mapped_bytes(NULL) == 0);
+}
+
+/**
+ * Short-lived, long-lived and plain blocks come from three separate
+ * pools, and mfree(), mrealloc() and mmal_usable_size() work on the pool
+ * owning a block.
+ */
+static
+void test_pools(void){
+    static char* blocks[3][N];
+    static const unsigned hints[3] = { MMAL_SHORT_LIVED, MMAL_LONG_LIVED, 0 };
+    for(size_t i = 0; i < N; i++){
+        for(int p = 0; p < 3; p++){
+            blocks[p][i] = mmal_malloc_hint(64, hints[p]);
+            CHECK(blocks[p][i] != NULL && mmal_usable_size(blocks[p][i]) >= 64);
+            test_fill(blocks[p][i], 64, (unsigned)(p*N + i));
+        }
+    }
+
+    /// Allocated in turns, the blocks of one pool still lie next to each
+    /// other, with none of the other pools in between
+    for(int p = 0; p < 3; p++){
+        char* low = blocks[p][0];
+        char* high = blocks[p][N-1];
+        size_t step = (size_t)(blocks[p][1] - low);
+        for(size_t i = 1; i < N; i++)
+            CHECK((size_t)(blocks[p][i] - blocks[p][i-1]) == step);
+        for(int q = 0; q < 3; q++){
+            if(q == p) continue;
+            for(size_t i = 0; i < N; i++)
+                CHECK(blocks[q][i] < low || blocks[q][i] > high);
+        }
+    }
+
+    /// A freed block goes back to its own pool and is reused from there
+    for(int p = 0; p < 3; p++){
+        char* ptr = blocks[p][N/2];
+        mfree(ptr);
+        blocks[p][N/2] = mmal_malloc_hint(64, hints[p]);
+        CHECK(blocks[p][N/2] == ptr);
+        test_fill(ptr, 64, (unsigned)(p*N + N/2));
+    }
+
+    /// Growing a hint block keeps it out of the default heap
+    size_t mapped = mmal_heap_mapped_bytes(NULL);
+    for(int p = 0; p < 2; p++){
+        for(size_t i = 0; i < N; i += 20){
+            size_t size = mapped + (1 << 20);
+            char* ptr = mrealloc(blocks[p][i], size);
+            CHECK(ptr != NULL && mmal_usable_size(ptr) >= size);
+            CHECK(test_holds(ptr, 64, (unsigned)(p*N + i)));
+            blocks[p][i] = mrealloc(ptr, 64);
+            CHECK(blocks[p][i] != NULL && mmal_usable_size(blocks[p][i]) >= 64);
+            CHECK(test_holds(blocks[p][i], 64, (unsigned)(p*N + i)));
+        }
+    }
+    CHECK(mmal_heap_mapped_bytes(NULL) == mapped);
+
+    for(int p = 0; p < 3; p++){
+        for(size_t i = 0; i < N; i++){
+            CHECK(test_holds(blocks[p][i], 64, (unsigned)(p*N + i)));
+            mfree(blocks[p][i]);
+        }
+    }
+}
+
+int main(void){
+    RUN(test_batch);
+    RUN(test_pools);
+    return 0;
+}
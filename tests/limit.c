@@ -0,0 +1,97 @@
+/**
+ * Regression tests of the memory limits and the OOM handler of a heap.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/limit.c mmal.c -o test_limit -lpthread && ./test_limit
+ */
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+static void* cache[4096];
+static size_t cache_len;
+static unsigned oom_calls;
+
+/**
+ * OOM handler evicting cache entries, like a program's cache would.
+ */
+static
+bool evict(mmal_heap_t* heap, size_t size, void* arg){
+    (void)size;
+    CHECK(arg == &cache_len);
+    oom_calls++;
+    if(cache_len == 0) return false;
+    for(size_t i = 0; i < 64 && cache_len > 0; i++)
+        mmal_heap_free(heap, cache[--cache_len]);
+    return true;
+}
+
+/**
+ * MMAL_OPT_HARD_LIMIT stops the heap from growing, the OOM handler frees
+ * space to retry with.
+ */
+static
+void test_hard_limit(void){
+    mmal_heap_t* heap = mmal_heap_create();
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_HARD_LIMIT, 4 << 20));
+    CHECK(mmal_heap_mapped_bytes(heap) == 0);
+
+    void* ptr;
+    while((ptr = mmal_heap_malloc(heap, 10000)) != NULL){
+        CHECK(cache_len < sizeof(cache)/sizeof(cache[0]));
+        cache[cache_len++] = ptr;
+    }
+    CHECK(cache_len > 0);
+    CHECK(mmal_heap_mapped_bytes(heap) <= 4 << 20);
+    CHECK(mmal_heap_realloc(heap, cache[0], 8 << 20) == NULL);
+    CHECK(mmal_heap_aligned_alloc(heap, 4096, 100000) == NULL);
+
+    CHECK(mmal_heap_set_oom_handler(heap, evict, &cache_len));
+    for(int i = 0; i < 1000; i++){
+        ptr = mmal_heap_malloc(heap, 10000);
+        CHECK(ptr != NULL);
+        cache[cache_len++] = ptr;
+    }
+    CHECK(oom_calls > 0);
+    CHECK(mmal_heap_mapped_bytes(heap) <= 4 << 20);
+
+    /// Nothing the handler frees is enough: it is called until it gives up
+    CHECK(mmal_heap_malloc(heap, 8 << 20) == NULL);
+    CHECK(cache_len == 0);
+    mmal_heap_destroy(heap);
+}
+
+/**
+ * MMAL_OPT_SOFT_LIMIT unmaps free arenas right away, but lets the heap
+ * grow past it.
+ */
+static
+void test_soft_limit(void){
+    mmal_heap_t* heap = mmal_heap_create();
+    void* big[8];
+    for(int i = 0; i < 8; i++){
+        big[i] = mmal_heap_malloc(heap, 1 << 20);
+        CHECK(big[i] != NULL);
+    }
+    size_t mapped = mmal_heap_mapped_bytes(heap);
+    for(int i = 0; i < 8; i++) mmal_heap_free(heap, big[i]);
+    CHECK(mmal_heap_mapped_bytes(heap) == mapped);
+
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_SOFT_LIMIT, 2 << 20));
+    CHECK(mmal_heap_mapped_bytes(heap) < mapped);
+    for(int i = 0; i < 8; i++){
+        big[i] = mmal_heap_malloc(heap, 1 << 20);
+        CHECK(big[i] != NULL);
+    }
+    CHECK(mmal_heap_mapped_bytes(heap) > 2 << 20);
+    for(int i = 0; i < 8; i++) mmal_heap_free(heap, big[i]);
+    mmal_heap_maintain(heap);
+    CHECK(mmal_heap_mapped_bytes(heap) <= 2 << 20);
+    mmal_heap_destroy(heap);
+}
+
+int main(void){
+    RUN(test_hard_limit);
+    RUN(test_soft_limit);
+    return 0;
+}
@@ -0,0 +1,211 @@
+/**
+ * Regression tests of the placement policies: split placement, the search
+ * and the free list order.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/policy.c mmal.c -o test_policy -lpthread && ./test_policy
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+/**
+ * MMAL_OPT_SPLIT_BACK hands out the back of a split block and
+ * MMAL_OPT_MIN_SPLIT hands out a block whole when its rest is too small.
+ */
+static
+void test_split(void){
+    mmal_heap_t* heap = mmal_heap_create();
+    char* big = mmal_heap_malloc(heap, 10000);
+    char* guard = mmal_heap_malloc(heap, 16);
+    CHECK(big != NULL && guard != NULL);
+    mmal_heap_free(heap, big);
+
+    /// Front by default
+    char* front = mmal_heap_malloc(heap, 100);
+    CHECK(front == big);
+    mmal_heap_free(heap, front);
+
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_SPLIT_BACK, 1));
+    char* back = mmal_heap_malloc(heap, 100);
+    CHECK(back > big && back + 100 <= guard);
+    mmal_heap_free(heap, back);
+    CHECK(!mmal_heap_setopt(heap, MMAL_OPT_SPLIT_BACK, 2));
+    mmal_heap_destroy(heap);
+
+    heap = mmal_heap_create();
+    big = mmal_heap_malloc(heap, 4000);
+    guard = mmal_heap_malloc(heap, 16);
+    size_t whole = mmal_usable_size(big);
+    mmal_heap_free(heap, big);
+    CHECK(mmal_heap_setopt(heap, MMAL_OPT_MIN_SPLIT, whole));
+    char* small = mmal_heap_malloc(heap, 1000);
+    CHECK(small == big && mmal_usable_size(small) == whole);
+    mmal_heap_destroy(heap);
+}
+
+/**
+ * With MMAL_FIT_NEXT a search goes on after the last block handed out,
+ * first-fit starts at the beginning again. Both with the ring and with
+ * the address-ordered free list.
+ */
+static
+void test_fit(void){
+    for(int free_list = 0; free_list <= 2; free_list += 2){
+        for(int fit = MMAL_FIT_FIRST; fit <= MMAL_FIT_NEXT; fit++){
+            mmal_heap_t* heap = mmal_heap_create();
+            CHECK(mmal_heap_setopt(heap, MMAL_OPT_FREE_LIST, free_list));
+            void* ptrs[10];
+            for(int i = 0; i < 10; i++) ptrs[i] = mmal_heap_malloc(heap, 200);
+            CHECK(mmal_heap_setopt(heap, MMAL_OPT_FIT, fit));
+            mmal_heap_free(heap, ptrs[2]);
+            mmal_heap_free(heap, ptrs[6]);
+
+            void* x = mmal_heap_malloc(heap, 200);
+            void* y = mmal_heap_malloc(heap, 200);
+            CHECK(x == ptrs[2] && y == ptrs[6]);
+            mmal_heap_free(heap, x);
+            void* z = mmal_heap_malloc(heap, 200);
+            CHECK(fit == MMAL_FIT_FIRST ? z == ptrs[2] : z != ptrs[2]);
+            mmal_heap_destroy(heap);
+        }
+    }
+    CHECK(!mmal_heap_setopt(NULL, MMAL_OPT_FIT, 2));
+}
+
+/**
+ * The default free list reuses the block freed last and merges a freed
+ * block with free neighbours of every size, the smallest ones included.
+ */
+static
+void test_free_list(void){
+    mmal_heap_t* heap = mmal_heap_create();
+    void* ptrs[10];
+    for(int i = 0; i < 10; i++) ptrs[i] = mmal_heap_malloc(heap, 200);
+    mmal_heap_free(heap, ptrs[2]);
+    mmal_heap_free(heap, ptrs[6]);
+    CHECK(mmal_heap_malloc(heap, 200) == ptrs[6]);
+    CHECK(mmal_heap_malloc(heap, 200) == ptrs[2]);
+    mmal_heap_destroy(heap);
+    CHECK(!mmal_heap_setopt(NULL, MMAL_OPT_FREE_LIST, 3));
+
+    enum { N = 600 };
+    static char* blocks[N];
+    static size_t order[N];
+    uint64_t seed = 5;
+    for(int round = 0; round < 20; round++){
+        heap = mmal_heap_create();
+        size_t total = 0;
+        for(size_t i = 0; i < N; i++){
+            size_t size = 16 + 8 * (test_rnd(&seed) % 4);
+            blocks[i] = mmal_heap_malloc(heap, size);
+            CHECK(blocks[i] != NULL);
+            test_fill(blocks[i], mmal_usable_size(blocks[i]), (unsigned)i);
+            total += mmal_usable_size(blocks[i]) + (i != 0 ? 24 : 0);
+            order[i] = i;
+        }
+        char* guard = mmal_heap_malloc(heap, 16);
+        for(size_t i = N-1; i > 0; i--){
+            size_t j = test_rnd(&seed) % (i+1);
+            size_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+        for(size_t i = 0; i < N; i++){
+            size_t k = order[i];
+            CHECK(test_holds(blocks[k], mmal_usable_size(blocks[k]), (unsigned)k));
+            mmal_heap_free(heap, blocks[k]);
+        }
+
+        /// Everything in front of the guard is one block again
+        char* all = mmal_heap_malloc(heap, total);
+        CHECK(all == blocks[0] && all + total <= guard);
+        mmal_heap_destroy(heap);
+    }
+}
+
+/**
+ * Data of an allocated block that ends like the boundary tag of a free
+ * block, with a header to match, does not pass for one: the block after
+ * it is freed on its own and the data stays as it is.
+ */
+static
+void test_forged_foot(void){
+    mmal_heap_t* heap = mmal_heap_create();
+    char* front = mmal_heap_malloc(heap, 64);
+    char* back  = mmal_heap_malloc(heap, 64);
+    CHECK(back == front + mmal_usable_size(front) + sizeof(Header));
+
+    /// FREE_FOOT_TAG() of mmal.c over a header in the data of 'front'
+    Header* hdr  = &((Header*)back)[-1];
+    Header* fake = (Header*)((char*)hdr - sizeof(Header) - 32);
+    fake->next  = hdr;
+    fake->size  = 32;
+    fake->asize = 0;
+    size_t* foot = (size_t*)hdr - 2;
+    foot[0] = 32;
+    foot[1] = (uintptr_t)fake ^ (uintptr_t)0x6d6d616c666f6f74ull;
+    char saved[64];
+    memcpy(saved, front, sizeof(saved));
+
+    mmal_heap_free(heap, back);
+    CHECK(memcmp(saved, front, sizeof(saved)) == 0);
+    CHECK(mmal_heap_malloc(heap, 64) == back);
+    mmal_heap_destroy(heap);
+}
+
+/**
+ * Random allocations, frees and reallocations keep their contents under
+ * every combination of the search options.
+ */
+static
+void test_churn(void){
+    enum { N = 2000 };
+    static void* ptrs[N];
+    static size_t sizes[N];
+    for(int conf = 0; conf < 12; conf++){
+        mmal_heap_t* heap = mmal_heap_create();
+        CHECK(mmal_heap_setopt(heap, MMAL_OPT_FREE_LIST, conf % 3));
+        CHECK(mmal_heap_setopt(heap, MMAL_OPT_FIT, (conf / 3) & 1));
+        CHECK(mmal_heap_setopt(heap, MMAL_OPT_SPLIT_BACK, (conf / 6) & 1));
+        uint64_t seed = 42 + (uint64_t)conf;
+        for(int op = 0; op < 30000; op++){
+            size_t i = test_rnd(&seed) % N;
+            if(ptrs[i] != NULL){
+                CHECK(test_holds(ptrs[i], sizes[i], (unsigned)i));
+                if(test_rnd(&seed) & 1){
+                    mmal_heap_free(heap, ptrs[i]);
+                    ptrs[i] = NULL;
+                    continue;
+                }
+                size_t size = test_rnd(&seed) % 4000 + 1;
+                void* ptr = mmal_heap_realloc(heap, ptrs[i], size);
+                CHECK(ptr != NULL);
+                CHECK(test_holds(ptr, size < sizes[i] ? size : sizes[i], (unsigned)i));
+                ptrs[i] = ptr;
+                sizes[i] = size;
+            }
+            else{
+                sizes[i] = test_rnd(&seed) % 2000 + 1;
+                ptrs[i] = mmal_heap_malloc(heap, sizes[i]);
+                CHECK(ptrs[i] != NULL);
+            }
+            test_fill(ptrs[i], sizes[i], (unsigned)i);
+        }
+        /// Destroying the heap releases the blocks still allocated
+        memset(ptrs, 0, sizeof(ptrs));
+        mmal_heap_destroy(heap);
+    }
+}
+
+int main(void){
+    RUN(test_split);
+    RUN(test_fit);
+    RUN(test_free_list);
+    RUN(test_forged_foot);
+    RUN(test_churn);
+    return 0;
+}
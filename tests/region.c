@@ -0,0 +1,48 @@
+/**
+ * Regression tests of the bump-pointer regions.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/region.c mmal.c -o test_region -lpthread && ./test_region
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+/**
+ * Region blocks are aligned and distinct, sizes close to SIZE_MAX fail,
+ * and a region keeps working after a failed or reset allocation.
+ */
+static
+void test_region(void){
+    for(unsigned flags = 0; flags <= MMAL_REGION_KEEP; flags++){
+        mmal_region_t* region = mmal_region_create(flags);
+        CHECK(region != NULL);
+        CHECK(mmal_region_alloc(region, 0) == NULL);
+        for(size_t d = 0; d < 256; d++)
+            CHECK(mmal_region_alloc(region, SIZE_MAX - d) == NULL);
+        CHECK(mmal_region_alloc(region, SIZE_MAX/2) == NULL);
+
+        for(int round = 0; round < 3; round++){
+            char* prev = NULL;
+            for(size_t i = 0; i < 2000; i++){
+                size_t size = i % 7 == 0 ? 100000 : i % 300 + 1;
+                char* ptr = mmal_region_alloc(region, size);
+                CHECK(ptr != NULL);
+                CHECK(((uintptr_t)ptr & (MMAL_REGION_ALIGN-1)) == 0);
+                CHECK(ptr != prev);
+                memset(ptr, (int)i, size);
+                prev = ptr;
+            }
+            mmal_region_reset(region);
+        }
+        mmal_region_release(region);
+    }
+}
+
+int main(void){
+    RUN(test_region);
+    return 0;
+}
@@ -0,0 +1,103 @@
+/**
+ * Regression tests of the size-aware calls: sized free, in-place
+ * expansion and usable sizes.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/resize.c mmal.c -o test_resize -lpthread && ./test_resize
+ */
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+/**
+ * mfree_sized() frees like mfree(): the space is merged and reused.
+ */
+static
+void test_sized(void){
+    for(size_t size = 16; size <= 100000; size *= 5){
+        char* a = mmalloc(size);
+        char* b = mmalloc(size);
+        char* guard = mmalloc(16);
+        CHECK(a != NULL && b != NULL && guard != NULL);
+        test_fill(a, size, 1);
+        test_fill(b, size, 2);
+        mfree_sized(a, size);
+        mfree_sized(b, size);
+
+        /// Only the merged pair has room for this
+        char* pair = mmalloc(2*size);
+        CHECK(pair == a);
+        mfree_sized(pair, 2*size);
+        mfree(guard);
+    }
+
+    /// Any size up to the usable size of the block is accepted
+    char* c = mmalloc(100);
+    CHECK(c != NULL);
+    mfree_sized(c, mmal_usable_size(c));
+    mfree_sized(NULL, 100);
+}
+
+/**
+ * mmal_try_expand() grows in place only. mrealloc() grows into a free
+ * block in front when the one behind is taken, and keeps the contents.
+ */
+static
+void test_expand(void){
+    char* a = mmalloc(100);
+    char* b = mmalloc(100);
+    CHECK(a != NULL && b != NULL);
+    size_t usable = mmal_usable_size(a);
+    test_fill(a, usable, 3);
+    CHECK(!mmal_try_expand(a, usable + 1000));
+    CHECK(test_holds(a, usable, 3));
+
+    mfree(b);
+    CHECK(mmal_try_expand(a, usable + 50));
+    CHECK(mmal_usable_size(a) >= usable + 50);
+    CHECK(test_holds(a, usable, 3));
+
+    char* c = mrealloc(a, 100000);
+    CHECK(c != NULL && test_holds(c, usable, 3));
+    mfree(c);
+
+    /// Backward merge: the block moves down into the freed one
+    char* front = mmalloc(200);
+    char* block = mmalloc(200);
+    char* guard = mmalloc(16);
+    CHECK(front != NULL && block != NULL && guard != NULL);
+    test_fill(block, 200, 4);
+    mfree(front);
+    char* moved = mrealloc(block, 350);
+    CHECK(moved == front && test_holds(moved, 200, 4));
+    mfree(moved);
+    mfree(guard);
+}
+
+/**
+ * mmal_malloc_usable() reports the usable size of the block, which a
+ * growing container fills without moving it.
+ */
+static
+void test_usable(void){
+    size_t usable = 0;
+    char* a = mmal_malloc_usable(100, &usable);
+    CHECK(a != NULL && usable >= 100 && usable == mmal_usable_size(a));
+    test_fill(a, usable, 3);
+    CHECK(mrealloc(a, usable) == a);
+    CHECK(test_holds(a, usable, 3));
+    mfree(a);
+
+    a = mmal_malloc_usable(100, NULL);
+    CHECK(a != NULL && mmal_usable_size(a) >= 100);
+    mfree(a);
+    CHECK(mmal_malloc_usable(0, &usable) == NULL);
+    CHECK(mmal_usable_size(NULL) == 0);
+}
+
+int main(void){
+    RUN(test_sized);
+    RUN(test_expand);
+    RUN(test_usable);
+    return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * Regression tests of shared-memory heaps used by several processes.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/shared.c mmal.c -o test_shared -lpthread && ./test_shared
+ */
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+static
+bool no_oom(mmal_heap_t* heap, size_t size, void* arg){
+    (void)heap; (void)size; (void)arg;
+    return false;
+}
+
+/**
+ * Blocks of a shared heap are allocated, checked and freed by forked and
+ * attached processes alike. A shared heap takes no OOM handler and no
+ * maintenance thread.
+ */
+static
+void test_shared(void){
+    enum { PROCS = 4, SLOTS = 64 };
+    int fd = -1;
+    mmal_heap_t* heap = mmal_heap_create_shared(8 << 20, &fd);
+    CHECK(heap != NULL && fd >= 0);
+    CHECK(!mmal_heap_set_oom_handler(heap, no_oom, NULL));
+    CHECK(!mmal_heap_maintenance_start(heap, 10));
+    CHECK(mmal_heap_halloc(heap, 32) == NULL);
+    CHECK(mmal_heap_attach_shared(fd) == NULL);
+
+    size_t* slots = mmal_heap_malloc(heap, PROCS*SLOTS*sizeof(size_t));
+    CHECK(slots != NULL);
+    memset(slots, 0, PROCS*SLOTS*sizeof(size_t));
+    CHECK(mmal_heap_set_root(heap, slots));
+
+    for(int p = 0; p < PROCS; p++){
+        if(fork() != 0) continue;
+        /// Odd children attach the segment like an unrelated process would
+        mmal_heap_t* own = heap;
+        if(p % 2 == 1){
+            mmal_heap_destroy(heap);
+            own = mmal_heap_attach_shared(fd);
+            CHECK(own == heap);
+        }
+        size_t* table = mmal_heap_root(own);
+        uint64_t seed = 77 + (uint64_t)p;
+        for(int op = 0; op < 5000; op++){
+            size_t i = (size_t)p*SLOTS + test_rnd(&seed) % SLOTS;
+            unsigned char* data = mmal_heap_at(own, table[i]);
+            if(data != NULL){
+                size_t size = *(size_t*)data;
+                CHECK(test_holds(data + sizeof(size_t), size, (unsigned)i));
+                mmal_heap_free(own, data);
+                table[i] = 0;
+            }
+            else{
+                size_t size = test_rnd(&seed) % 2000 + 1;
+                data = mmal_heap_malloc(own, sizeof(size_t) + size);
+                CHECK(data != NULL);
+                *(size_t*)data = size;
+                test_fill(data + sizeof(size_t), size, (unsigned)i);
+                table[i] = mmal_heap_offset(own, data);
+            }
+        }
+        _exit(0);
+    }
+    for(int p = 0; p < PROCS; p++){
+        int status;
+        CHECK(wait(&status) > 0);
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    /// The parent sees and frees what the children left
+    for(size_t i = 0; i < PROCS*SLOTS; i++){
+        unsigned char* data = mmal_heap_at(heap, slots[i]);
+        if(data == NULL) continue;
+        CHECK(test_holds(data + sizeof(size_t), *(size_t*)data, (unsigned)i));
+        mmal_heap_free(heap, data);
+    }
+    mmal_heap_free(heap, slots);
+    mmal_heap_destroy(heap);
+    close(fd);
+}
+
+int main(void){
+    RUN(test_shared);
+    return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * Regression tests of allocation site learning: sites are judged by the
+ * lifetime of their samples, routed to the hint pools, saved and loaded,
+ * and not routed past the limits of the default heap. Aligned calls are
+ * sites as well.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/site.c mmal.c -o test_site -lpthread && ./test_site
+ */
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "mmal.h"
+#include "mmal_ext.h"
+#include "test.h"
+
+#define KEEP 20000
+
+static void* keep[KEEP];
+
+/// A site is the return address of mmalloc(): site functions must be
+/// neither inlined nor cloned per caller, nor end in a tail call.
+#ifdef __clang__
+#define SITE_FUNCTION __attribute__((noinline))
+#else
+#define SITE_FUNCTION __attribute__((noipa))
+#endif
+#define SITE_BARRIER() __asm__ volatile("" ::: "memory")
+
+/// Site whose blocks are freed right away.
+SITE_FUNCTION
+static
+void* short_site(size_t size){
+    void* ptr = mmalloc(size);
+    SITE_BARRIER();
+    return ptr;
+}
+
+/// Site whose blocks outlive tens of MiB of allocations.
+SITE_FUNCTION
+static
+void* long_site(size_t size){
+    void* ptr = mmalloc(size);
+    SITE_BARRIER();
+    return ptr;
+}
+
+/// Site of aligned blocks that are freed right away.
+SITE_FUNCTION
+static
+void* aligned_site(size_t size){
+    void* ptr = mmal_aligned_alloc(64, size);
+    SITE_BARRIER();
+    return ptr;
+}
+
+/**
+ * Allocate from both sites until enough of their samples have ended.
+ */
+static
+void train(void){
+    size_t k = 0;
+    for(int round = 0; round < 2000; round++){
+        for(int i = 0; i < 1000; i++){
+            void* ptr = short_site(64 + (size_t)i % 100);
+            CHECK(ptr != NULL);
+            memset(ptr, 1, 64);
+            mfree(ptr);
+        }
+        for(int i = 0; i < 10; i++, k++){
+            mfree(keep[k % KEEP]);
+            keep[k % KEEP] = long_site(4096);
+            CHECK(keep[k % KEEP] != NULL);
+        }
+    }
+}
+
+/**
+ * Learned sites allocate outside the default heap, forgotten sites in it
+ * again; a saved profile restores the placement.
+ */
+static
+void test_learn(void){
+    mmal_site_learn(16);
+    train();
+    mmal_site_learn(0);
+
+    /// Routed blocks do not grow the default heap
+    size_t mapped = mmal_heap_mapped_bytes(NULL);
+    void* big[16];
+    for(int i = 0; i < 16; i++){
+        big[i] = long_site(1 << 16);
+        CHECK(big[i] != NULL);
+        memset(big[i], 2, 1 << 16);
+    }
+    CHECK(mmal_heap_mapped_bytes(NULL) == mapped);
+    for(int i = 0; i < 16; i++){
+        void* ptr = mrealloc(big[i], 1 << 17);
+        CHECK(ptr != NULL);
+        mfree(ptr);
+    }
+
+    char path[] = "/tmp/mmal_sites_XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    CHECK(mmal_site_save(path));
+
+    for(size_t i = 0; i < KEEP; i++){
+        mfree(keep[i]);
+        keep[i] = NULL;
+    }
+    mmal_site_reset();
+    void* plain = long_site(1 << 20);
+    CHECK(plain != NULL && mmal_heap_mapped_bytes(NULL) > mapped);
+    mfree(plain);
+
+    CHECK(mmal_site_load(path));
+    mapped = mmal_heap_mapped_bytes(NULL);
+    for(int i = 0; i < 16; i++) big[i] = long_site(1 << 20);
+    CHECK(mmal_heap_mapped_bytes(NULL) == mapped);
+    mmal_free_batch(big, 16);
+    mmal_site_reset();
+    unlink(path);
+    CHECK(!mmal_site_load(path));
+}
+
+/**
+ * With a hard limit on the default heap, learned sites stay in it and the
+ * limit holds for them.
+ */
+static
+void test_limit(void){
+    mmal_site_learn(16);
+    train();
+    mmal_site_learn(0);
+
+    size_t mapped = mmal_heap_mapped_bytes(NULL);
+    CHECK(mmal_heap_setopt(NULL, MMAL_OPT_HARD_LIMIT, mapped + (1 << 20)));
+    void* big[256];
+    size_t got = 0;
+    for(int i = 0; i < 256; i++){
+        big[i] = long_site(1 << 16);
+        if(big[i] != NULL) got++;
+    }
+    CHECK(got > 0 && got < 256);
+    CHECK(mmal_heap_mapped_bytes(NULL) <= mapped + (1 << 20));
+    mmal_free_batch(big, 256);
+    CHECK(mmal_heap_setopt(NULL, MMAL_OPT_HARD_LIMIT, 0));
+
+    for(size_t i = 0; i < KEEP; i++){
+        mfree(keep[i]);
+        keep[i] = NULL;
+    }
+    mmal_site_reset();
+}
+
+/**
+ * mmal_aligned_alloc() calls are sites too: once learned, their blocks
+ * are allocated outside the default heap and still aligned.
+ */
+static
+void test_aligned(void){
+    mmal_site_learn(16);
+    for(int i = 0; i < 200000; i++){
+        void* ptr = aligned_site(64 + (size_t)i % 100);
+        CHECK(ptr != NULL && ((uintptr_t)ptr & 63) == 0);
+        memset(ptr, 1, 64);
+        mfree(ptr);
+    }
+    mmal_site_learn(0);
+
+    /// More than the default heap has spare
+    size_t mapped = mmal_heap_mapped_bytes(NULL);
+    void* big[16];
+    for(int i = 0; i < 16; i++){
+        big[i] = aligned_site(mapped / 8 + (1 << 20));
+        CHECK(big[i] != NULL && ((uintptr_t)big[i] & 63) == 0);
+        memset(big[i], 2, 4096);
+    }
+    CHECK(mmal_heap_mapped_bytes(NULL) == mapped);
+    mmal_free_batch(big, 16);
+    mmal_site_reset();
+}
+
+int main(void){
+    RUN(test_learn);
+    RUN(test_limit);
+    RUN(test_aligned);
+    return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * Regression tests of the operator new of mmal_new.cpp: C++ allocations
+ * are sampled, learned and routed to the hint pools like mmalloc() calls,
+ * and threads may allocate and free concurrently.
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. -c mmal.c -o mmal.o
+ *   c++ -std=c++17 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/site_new.cpp mmal_new.cpp mmal.o -o test_site_new -lpthread \
+ *      && ./test_site_new
+ */
+#include <cstring>
+#include <thread>
+
+#include "mmal.hpp"
+#include "test.h"
+
+/// The compiler may leave out a new/delete pair whose block is not used.
+#define ESCAPE(ptr) __asm__ volatile("" :: "r"(ptr) : "memory")
+
+/**
+ * Short-lived new[] calls teach their site, later ones are allocated
+ * outside the default heap.
+ */
+static
+void test_new(void){
+    mmal_site_learn(16);
+    for(int i = 0; i < 200000; i++){
+        char* ptr = new char[64 + i % 100];
+        std::memset(ptr, 1, 64);
+        ESCAPE(ptr);
+        delete[] ptr;
+    }
+    mmal_site_learn(0);
+
+    /// Routed blocks do not grow the default heap, though they are more
+    /// than it has spare
+    size_t mapped = mmal_heap_mapped_bytes(NULL);
+    char* big[16];
+    for(int i = 0; i < 16; i++){
+        big[i] = new char[mapped / 8 + (1 << 20)];
+        std::memset(big[i], 2, 4096);
+        ESCAPE(big[i]);
+    }
+    CHECK(mmal_heap_mapped_bytes(NULL) == mapped);
+    for(int i = 0; i < 16; i++) delete[] big[i];
+
+    /// Forgotten sites allocate in the default heap again
+    mmal_site_reset();
+    char* plain = new char[mapped + (1 << 20)];
+    ESCAPE(plain);
+    CHECK(mmal_heap_mapped_bytes(NULL) > mapped);
+    delete[] plain;
+}
+
+/**
+ * Allocate, check and free blocks of random sizes, a few of them kept
+ * alive for a while.
+ */
+static
+void churn(unsigned tag){
+    enum { LIVE = 64 };
+    char* live[LIVE] = {};
+    size_t sizes[LIVE] = {};
+    uint64_t seed = 11 + tag;
+    for(int op = 0; op < 100000; op++){
+        size_t i = test_rnd(&seed) % LIVE;
+        if(live[i] != nullptr){
+            CHECK(test_holds(live[i], sizes[i], tag + (unsigned)i));
+            delete[] live[i];
+        }
+        sizes[i] = test_rnd(&seed) % 500 + 1;
+        live[i] = new char[sizes[i]];
+        test_fill(live[i], sizes[i], tag + (unsigned)i);
+    }
+    for(size_t i = 0; i < LIVE; i++){
+        CHECK(live[i] == nullptr || test_holds(live[i], sizes[i], tag + (unsigned)i));
+        delete[] live[i];
+    }
+}
+
+/**
+ * Threads use new and delete at the same time, as the standard library
+ * does behind the program's back.
+ */
+static
+void test_threads(void){
+    std::thread others[3];
+    for(unsigned t = 0; t < 3; t++) others[t] = std::thread(churn, 100 * (t+1));
+    churn(0);
+    for(std::thread& other: others) other.join();
+}
+
+int main(void){
+    RUN(test_new);
+    RUN(test_threads);
+    return 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * Regression tests of the size class tables: every class fits its run,
+ * the classes grow, and the size-to-class lookup round-trips. Written in
+ * the common subset of C and C++, tests/sizeclass_constexpr.cpp runs it
+ * on the constexpr tables. `make check` also builds it with a few other
+ * parameter sets:
+ *
+ *   cc -std=gnu11 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/sizeclass.c -o test_sizeclass && ./test_sizeclass
+ */
+#include "mmal_sizeclass.h"
+#include "test.h"
+
+/**
+ * Classes start at the quantum, grow and end at the largest small size.
+ * A run is whole pages holding at least one block, and the slot of every
+ * byte of a run is found by mmal_sc_slot().
+ */
+static
+void test_classes(void){
+    CHECK(mmal_sc_info[0].size == MMAL_SC_QUANTUM);
+    CHECK(mmal_sc_info[MMAL_SC_NCLASSES-1].size == MMAL_SC_MAX_SMALL);
+    for(unsigned sc = 0; sc < MMAL_SC_NCLASSES; sc++){
+        const mmal_sc_info_t* info = &mmal_sc_info[sc];
+        CHECK(info->size % MMAL_SC_QUANTUM == 0);
+        CHECK(sc == 0 || info->size > mmal_sc_info[sc-1].size);
+        CHECK(info->run_size % MMAL_SC_RUN_PAGE == 0);
+        CHECK(info->run_size >= info->size);
+        CHECK(info->slots >= 1 && info->slots == info->run_size / info->size);
+        CHECK(info->recip == MMAL_SC_RECIP(info->size));
+        for(uint32_t slot = 0; slot < info->slots; slot++){
+            CHECK(mmal_sc_slot(sc, slot * info->size) == slot);
+            CHECK(mmal_sc_slot(sc, slot * info->size + info->size-1) == slot);
+        }
+    }
+}
+
+/**
+ * Every small size maps to the smallest class holding it, and every
+ * class size to its own class.
+ */
+static
+void test_lookup(void){
+    for(size_t size = 1; size <= MMAL_SC_MAX_SMALL; size++){
+        unsigned sc = mmal_sc_index(size);
+        CHECK(sc < MMAL_SC_NCLASSES);
+        CHECK(mmal_sc_info[sc].size >= size);
+        CHECK(sc == 0 || mmal_sc_info[sc-1].size < size);
+        CHECK(mmal_sc_round(size) == mmal_sc_info[sc].size);
+    }
+    for(unsigned sc = 0; sc < MMAL_SC_NCLASSES; sc++)
+        CHECK(mmal_sc_index(mmal_sc_info[sc].size) == sc);
+}
+
+int main(void){
+    RUN(test_classes);
+    RUN(test_lookup);
+    return 0;
+}
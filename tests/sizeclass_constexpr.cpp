@@ -0,0 +1,28 @@
+/**
+ * The size class tables as C++ constexpr: their checks hold at compile
+ * time, and the C tests run on them as well.
+ *
+ *   c++ -std=c++17 -g -O1 -fsanitize=address,undefined -fno-sanitize-recover=all \
+ *      -I. tests/sizeclass_constexpr.cpp -o test_sizeclass_constexpr \
+ *      && ./test_sizeclass_constexpr
+ */
+#include "mmal_sizeclass.h"
+
+/**
+ * Whether every class grows, fits its run and is its own lookup result.
+ */
+static constexpr
+bool classes_valid(void){
+    for(unsigned sc = 0; sc < MMAL_SC_NCLASSES; sc++){
+        const mmal_sc_info_t& info = mmal_sc_info[sc];
+        if(sc > 0 && info.size <= mmal_sc_info[sc-1].size) return false;
+        if(info.run_size < info.size || info.slots == 0) return false;
+        if(mmal_sc_index(info.size) != sc) return false;
+    }
+    return true;
+}
+
+static_assert(classes_valid(), "invalid size class tables");
+static_assert(mmal_sc_index(MMAL_SC_QUANTUM + 1) == 1, "lookup past the first class");
+
+#include "sizeclass.c"
@@ -0,0 +1,60 @@
+/**
+ * Helpers shared by the regression tests.
+ *
+ * Every test is a standalone program built against mmal.c, preferably
+ * with the sanitizers on; `make check` builds and runs them all, the
+ * header of each test has its own command.
+ * A failed check prints its location and aborts, a passing program prints
+ * one "ok" line per test function and exits with 0.
+ */
+#ifndef MMAL_TEST_H
+#define MMAL_TEST_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/// Abort with the failed condition and its location.
+#define CHECK(cond) do{ \
+        if(!(cond)){ \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    }while(0)
+
+/// Run a test function and report it.
+#define RUN(test) do{ \
+        test(); \
+        printf("%-24s ok\n", #test); \
+    }while(0)
+
+/**
+ * xorshift64 step, deterministic across runs.
+ */
+static inline
+uint64_t test_rnd(uint64_t* s){
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+/**
+ * Fill 'size' bytes with a pattern derived from 'tag'.
+ */
+static inline
+void test_fill(void* ptr, size_t size, unsigned tag){
+    for(size_t i = 0; i < size; i++) ((unsigned char*)ptr)[i] = (unsigned char)(tag + i);
+}
+
+/**
+ * Check a pattern written by test_fill().
+ */
+static inline
+int test_holds(const void* ptr, size_t size, unsigned tag){
+    for(size_t i = 0; i < size; i++)
+        if(((const unsigned char*)ptr)[i] != (unsigned char)(tag + i)) return 0;
+    return 1;
+}
+
+#endif // MMAL_TEST_H